@@ -0,0 +1,277 @@
+// Benchmarks of the hot parts of rand-brain-evo
+// Usage: $0 [--threads N] [--time SECONDS]
+// The runs use fixed seeds and canned genomes of different sizes, so the results can be compared between versions.
+// Each measurement is printed as a JSON object on a line of its own; the logs of the evolution code go to stderr
+
+#define BENCH // leaves out the main of rand-brain-evo
+#include "rand-brain-evo.c"
+
+#define BENCH_SEED 12345
+#define BENCH_WIDTH 16 // weights in a layer of the canned genomes
+#define BENCH_FILE "bench-genepool.dat"
+
+struct bench_genome_t {
+    const char *name;
+    int weights;
+};
+
+const struct bench_genome_t bench_genomes[] = {
+    { "tiny", 10 },
+    { "100", 100 },
+    { "1k", 1000 },
+    { "10k", MAX_WEIGHTS - 10 } // as many as fit into a brain
+};
+#define BENCH_GENOMES 4
+
+double bench_time = .5; // seconds to run each measurement for at least
+
+
+// Make genes with a given number of weights in layers of BENCH_WIDTH: the first layer takes the inputs,
+// and each layer feeds a sumsi that is the input of the next one. The last sumsi is the output,
+// so none of the weights are pruned
+void bench_make_genes(struct genes_t *genes, int weights, struct rng_t *rng) {
+    struct genes_builder_t builder;
+    int done = 0, width, j;
+    genes_builder_begin(&builder, weights * 4 + 2 * (weights / BENCH_WIDTH + 1) + 1);
+    while(done < weights) {
+        width = (weights - done < BENCH_WIDTH ? weights - done : BENCH_WIDTH);
+        for(j=0; j<width; j++) {
+            genes_builder_add(&builder, CMD_NEW_WEIGHT, (int)(getrand(rng) * 200. - 100.));
+            if(done == 0) { genes_builder_add(&builder, CMD_WEIGHT_TO_INPUT, j % NUM_INPUTS); }
+            else { genes_builder_add(&builder, CMD_SUMSI_TO_WEIGHT_IN, 0); }
+        }
+        genes_builder_add(&builder, CMD_NEW_SUMSI, ARG_DUMMY);
+        for(j=0; j<width; j++) {
+            genes_builder_add(&builder, CMD_WEIGHT_TO_SUMSI_IN, 0);
+            genes_builder_add(&builder, CMD_POP_WEIGHT, ARG_DUMMY);
+        }
+        done += width;
+    }
+    genes_builder_add(&builder, CMD_SUMSI_TO_OUT, ARG_DUMMY);
+    genes_builder_end(&builder, genes);
+    genes->learning_rate = INITIAL_LEARNING_RATE;
+    genes->thinking_time = INITIAL_THINKING_TIME;
+    genes->changed_from = 0;
+}
+
+
+// Print a measurement
+void bench_report(const char *bench, const char *genome, int weights, long ops, double seconds) {
+    printf("{\"bench\":\"%s\",\"genome\":\"%s\",\"weights\":%d,\"ops\":%ld,\"seconds\":%.6f,\"ns_per_op\":%.6g,\"ops_per_s\":%.6g}\n",
+        bench, genome, weights, ops, seconds, seconds * 1e9 / ops, ops / seconds);
+    fflush(stdout);
+}
+
+
+// Measure the time of brain_play_step with the brain of each canned genome
+void bench_brain_play_step(struct genes_t *genes, struct brain_t *brains) {
+    TYPE_VALUE input_state[NUM_INPUTS] = { .1, -.2, .3, -.4, .5, -.6, 0., .5, 1. };
+    struct rng_t rng;
+    long ops, k;
+    double start, seconds;
+    for(int g=0; g<BENCH_GENOMES; g++) {
+        rng_init(&rng, RNG_PLAY, 0, g);
+        brain_play_init(&brains[g], &rng);
+        for(ops=1000; ; ops*=2) {
+            start = metrics_now();
+            for(k=0; k<ops; k++) { brain_play_step(&brains[g], input_state); }
+            seconds = metrics_now() - start;
+            if(seconds >= bench_time) { break; }
+        }
+        bench_report("brain_play_step", bench_genomes[g].name, brains[g].weight_num - 1, ops, seconds);
+    }
+}
+
+
+// Measure building the brains of the canned genomes, and mutating and crossing them over
+void bench_genes(struct genes_t *genes, struct brain_t *brains) {
+    struct genes_t *scratch = genes_alloc(3);
+    struct brain_t *brain = brain_alloc(1);
+    struct rng_t rng;
+    long ops, k;
+    double start, seconds;
+    for(int g=0; g<BENCH_GENOMES; g++) {
+        for(ops=4; ; ops*=2) {
+            start = metrics_now();
+            for(k=0; k<ops; k++) {
+                rng_init(&rng, RNG_BREED, 0, g);
+                genes_create_brain(&genes[g], brain, &rng);
+            }
+            seconds = metrics_now() - start;
+            if(seconds >= bench_time) { break; }
+        }
+        bench_report("genes_create_brain", bench_genomes[g].name, bench_genomes[g].weights, ops, seconds);
+
+        // The genes drift away from the canned ones, so they are cloned again for each round
+        for(ops=64; ; ops*=2) {
+            genes_clone(&genes[g], &scratch[0]);
+            start = metrics_now();
+            for(k=0; k<ops; k++) {
+                rng_init(&rng, RNG_BREED, 1, k);
+                genes_mutate(&scratch[0], &rng);
+            }
+            seconds = metrics_now() - start;
+            if(seconds >= bench_time) { break; }
+        }
+        bench_report("genes_mutate", bench_genomes[g].name, bench_genomes[g].weights, ops, seconds);
+
+        // Cross the genes over with a mutated copy
+        genes_clone(&genes[g], &scratch[0]);
+        rng_init(&rng, RNG_BREED, 2, g);
+        for(k=0; k<8; k++) { genes_mutate(&scratch[0], &rng); }
+        for(ops=64; ; ops*=2) {
+            start = metrics_now();
+            for(k=0; k<ops; k++) {
+                rng_init(&rng, RNG_CROSSOVER, 0, k);
+                genes_crossover(&genes[g], &scratch[0], &scratch[1], &scratch[2], &rng);
+            }
+            seconds = metrics_now() - start;
+            if(seconds >= bench_time) { break; }
+        }
+        bench_report("genes_crossover", bench_genomes[g].name, bench_genomes[g].weights, ops, seconds);
+    }
+    genes_clear(&scratch[0]);
+    genes_clear(&scratch[1]);
+    genes_clear(&scratch[2]);
+}
+
+
+// Measure making the tasks and getting values on the surface
+void bench_task(void) {
+    struct task_t *task = task_alloc();
+    TYPE_VALUE x, y, v, sum = 0;
+    long ops, k;
+    double start, seconds;
+
+    for(ops=16; ; ops*=2) {
+        start = metrics_now();
+        for(k=0; k<ops; k++) { task_init(task, 0, k); }
+        seconds = metrics_now() - start;
+        if(seconds >= bench_time) { break; }
+    }
+    bench_report("task_init", "", 0, ops, seconds);
+
+    task_init(task, 0, 0);
+    for(ops=1<<16; ; ops*=2) {
+        rng_init(&task->rng, RNG_TASK, 1, 0);
+        start = metrics_now();
+        for(k=0; k<ops; k++) { sum += task_get_value(task, task_get_coord(task), task_get_coord(task)); }
+        seconds = metrics_now() - start;
+        if(seconds >= bench_time) { break; }
+    }
+    bench_report("task_get_value", "", 0, ops, seconds);
+
+    // The points the questions are made of (see task_make_questions)
+    for(ops=1<<16; ; ops*=2) {
+        rng_init(&task->rng, RNG_TASK, 1, 0);
+        task->batch_ix = task->batch_num = 0;
+        start = metrics_now();
+        for(k=0; k<ops; k++) {
+            task_next_point(task, &x, &y, &v);
+            sum += v;
+        }
+        seconds = metrics_now() - start;
+        if(seconds >= bench_time) { break; }
+    }
+    bench_report("task_next_point", "", 0, ops, seconds);
+    if(sum == 12345.) { fprintf(stderr, "\n"); } // keep the values
+    free(task);
+}
+
+
+// Measure the evaluation of a pool of mutated copies of a canned genome, and saving and loading it
+void bench_pool(struct genes_t *genes, int g) {
+    struct genes_t *genepool = genes_alloc(POOL_SIZE);
+    struct brain_t *brainpool = brain_alloc(POOL_SIZE);
+    struct task_t *task = task_alloc();
+    struct checkpoint_t checkpoint;
+    TYPE_VALUE results[POOL_SIZE];
+    int same_as[POOL_SIZE];
+    struct rng_t rng;
+    long ops, k;
+    int i, t;
+    double start, seconds;
+
+    for(i=0; i<POOL_SIZE; i++) {
+        genes_clone(&genes[g], &genepool[i]);
+        rng_init(&rng, RNG_BREED, 3, i);
+        for(k=0; k<4; k++) { genes_mutate(&genepool[i], &rng); }
+        genes_create_brain(&genepool[i], &brainpool[i], &rng);
+        same_as[i] = i;
+    }
+
+    for(ops=1; ; ops*=2) {
+        start = metrics_now();
+        for(k=0; k<ops; k++) {
+            for(i=0; i<POOL_SIZE; i++) { results[i] = 0; }
+            for(t=0; t<TASK_NUM; t++) {
+                task_init(task, k, t);
+                evaluate(brainpool, task, results, 0, same_as, k, t);
+            }
+        }
+        seconds = metrics_now() - start;
+        if(seconds >= bench_time) { break; }
+    }
+    bench_report("evaluate_generation", bench_genomes[g].name, bench_genomes[g].weights, ops, seconds);
+
+    for(ops=1; ; ops*=2) {
+        start = metrics_now();
+        for(k=0; k<ops; k++) { checkpoint_save(genepool, BENCH_FILE); }
+        seconds = metrics_now() - start;
+        if(seconds >= bench_time) { break; }
+    }
+    bench_report("checkpoint_save", bench_genomes[g].name, bench_genomes[g].weights, ops, seconds);
+
+    for(ops=1; ; ops*=2) {
+        start = metrics_now();
+        for(k=0; k<ops; k++) {
+            checkpoint_open(&checkpoint, BENCH_FILE);
+            for(i=0; i<POOL_SIZE; i++) { checkpoint_genes(&checkpoint, i, &genepool[i]); }
+            checkpoint_close(&checkpoint);
+        }
+        seconds = metrics_now() - start;
+        if(seconds >= bench_time) { break; }
+    }
+    bench_report("checkpoint_load", bench_genomes[g].name, bench_genomes[g].weights, ops, seconds);
+    unlink(BENCH_FILE);
+    free(task);
+}
+
+
+int main(int argc, char **argv) {
+    int argi = 1, p_threads = 1;
+    struct rng_t rng;
+
+    while(argi < argc) {
+        if(strcmp(argv[argi], "--threads") == 0 && argi + 1 < argc) {
+            if(sscanf(argv[argi + 1], "%d", &p_threads) != 1) { die("Wrong usage - wrong number of threads"); }
+            argi += 2;
+        }
+        else if(strcmp(argv[argi], "--time") == 0 && argi + 1 < argc) {
+            if(sscanf(argv[argi + 1], "%lf", &bench_time) != 1) { die("Wrong usage - wrong time"); }
+            argi += 2;
+        }
+        else { die("Wrong usage"); }
+    }
+
+    rng_seed = BENCH_SEED;
+    brain_select_kernels();
+    threads_init(p_threads, -1);
+    printf("{\"bench\":\"config\",\"kernels\":\"%s\",\"threads\":%d,\"pool_size\":%d,\"steps\":%d,\"task_num\":%d,\"seed\":%d}\n",
+        brain_kernels, p_threads, POOL_SIZE, STEPS, TASK_NUM, BENCH_SEED);
+
+    struct genes_t *genes = genes_alloc(BENCH_GENOMES);
+    struct brain_t *brains = brain_alloc(BENCH_GENOMES);
+    for(int g=0; g<BENCH_GENOMES; g++) {
+        rng_init(&rng, RNG_INIT, 0, g);
+        bench_make_genes(&genes[g], bench_genomes[g].weights, &rng);
+        genes_create_brain(&genes[g], &brains[g], &rng);
+        if(brains[g].weight_num - 1 != bench_genomes[g].weights) { die("Canned genome has the wrong number of weights"); }
+    }
+
+    bench_brain_play_step(genes, brains);
+    bench_genes(genes, brains);
+    bench_task();
+    bench_pool(genes, 1);
+    return 0;
+}
@@ -1,16 +1,24 @@
 <?php
 
 // Launches the rand-brain-evo binary and manages it, and handles web requests for xpol (cross-pool communication)
+// The binary connects to a Unix-domain socket here; the messages it sends are uploaded to the server,
+// and the messages downloaded from the server are passed to it
 
 $PATH = dirname(__FILE__);
 require($PATH . '/config.php');
+if(!isset($p_socket)) { $p_socket = $PATH . '/xpol.sock'; }
+if(!isset($p_download_interval)) { $p_download_interval = 10; } // seconds
+if(!isset($p_download_count)) { $p_download_count = 4; } // messages to download at once
 $running = true;
-$state = 'noop';
+
+define('XPOL_MAGIC', 0x4C4F5058);
+define('XPOL_HEADER_SIZE', 32);
+define('XPOL_MAX_MESSAGE', 64 << 20);
 
 function lg($msg) { fwrite(STDERR, $msg); }
 
 function sighandler($signo) {
-    global $running, $state;
+    global $running;
     switch($signo) {
         case SIGTERM:
             lg("PHP: SIGTERM\n");
@@ -20,14 +28,6 @@ function sighandler($signo) {
             lg("PHP: SIGINT\n");
             $running = false;
             break;
-        case SIGUSR1:
-            lg("PHP: SIGUSR1 (download)\n");
-            $state = 'download';
-            break;
-        case SIGUSR2:
-            lg("PHP: SIGUSR2 (upload)\n");
-            $state = 'upload';
-            break;
     }
 }
 
@@ -48,42 +48,91 @@ function post($data) {
     return $result;
 }
 
+// Returns the size of the message starting with the header, or false if it is not a message (see xpol_header_t)
+function message_size($header) {
+    $h = unpack('Vmagic/Vgenes_num/Pcommand_num', $header);
+    if($h['magic'] != XPOL_MAGIC) { return false; }
+    $size = XPOL_HEADER_SIZE + $h['genes_num'] * 32 + $h['command_num'] * 8;
+    if($size > XPOL_MAX_MESSAGE) { return false; }
+    return $size;
+}
+
+$poolid = random_int(1, 0x7fffffff);
+@unlink($p_socket);
+$server = stream_socket_server('unix://' . $p_socket, $errno, $errstr);
+if($server === false) { lg("PHP: Cannot listen on $p_socket: $errstr\n"); exit(1); }
+
 $parentpid = getmypid();
 $childpid = pcntl_fork();
 if($childpid == -1) { lg("PHP: Cannot fork\n"); exit(1); }
 if($childpid == 0) {
     # Child code
-    pcntl_exec($p_exec, [$parentpid]);
+    pcntl_exec($p_exec, ['--xpol-connect', 'unix:' . $p_socket, $poolid]);
     exit(0);
 }
 # Parent code
 pcntl_async_signals(true);
 pcntl_signal(SIGTERM, "sighandler");
 pcntl_signal(SIGINT, "sighandler");
-pcntl_signal(SIGUSR1, "sighandler");
-pcntl_signal(SIGUSR2, "sighandler");
-lg("PHP: Parent PID: $parentpid Child PID: $childpid\n");
+lg("PHP: Parent PID: $parentpid Child PID: $childpid Pool id: $poolid\n");
+
+$conn = false;
+$inbuf = '';
+$last_download = 0;
 
-while($running) { 
-    sleep(1);
-    if($state == 'download') {
-        lg("PHP: Downloading\n");
-        $data = post(['todo'=>'get']);
-        file_put_contents($p_file, $data);
-        posix_kill($childpid, SIGUSR1);
+while($running) {
+    if($conn === false) {
+        $conn = @stream_socket_accept($server, 1);
+        if($conn !== false) { lg("PHP: Pool connected\n"); }
+        continue;
+    }
+    $read = [$conn];
+    $write = null;
+    $except = null;
+    if(@stream_select($read, $write, $except, 1) > 0) {
+        $data = fread($conn, 65536);
+        if($data === false || ($data === '' && feof($conn))) {
+            lg("PHP: Pool disconnected\n");
+            fclose($conn);
+            $conn = false;
+            $inbuf = '';
+            continue;
+        }
+        $inbuf .= $data;
+    }
+    // Upload the complete messages in one request
+    $upload = [];
+    while(strlen($inbuf) >= XPOL_HEADER_SIZE) {
+        $size = message_size($inbuf);
+        if($size === false) { lg("PHP: Invalid message from pool\n"); $running = false; break; }
+        if(strlen($inbuf) < $size) { break; }
+        $upload[] = base64_encode(substr($inbuf, 0, $size));
+        $inbuf = substr($inbuf, $size);
+    }
+    if(count($upload)) {
+        lg("PHP: Uploading ".count($upload)." messages\n");
+        post(['todo'=>'putmany', 'poolid'=>$poolid, 'data'=>$upload]);
     }
-    if($state == 'upload') {
-        lg("PHP: Uploading\n");
-        $data = file_get_contents($p_file);
-        lg("PHP: Uploading ".strlen($data)." bytes\n");
-        post(['todo'=>'put', 'data'=>$data]);
-        posix_kill($childpid, SIGUSR2);
+    // Download some messages now and then
+    if(time() - $last_download >= $p_download_interval) {
+        $last_download = time();
+        $result = post(['todo'=>'getmany', 'count'=>$p_download_count]);
+        if($result === false || $result === '') { continue; }
+        foreach(explode("\n", $result) as $data) {
+            $data = base64_decode($data, true);
+            if($data !== false && strlen($data) >= XPOL_HEADER_SIZE && message_size($data) === strlen($data)) {
+                lg("PHP: Downloaded ".strlen($data)." bytes\n");
+                fwrite($conn, $data);
+            }
+        }
     }
-    $state = 'noop';
 }
 
 lg("PHP: Sending TERM to child\n");
-posix_kill($childpid, SIGTERM); 
+posix_kill($childpid, SIGTERM);
 pcntl_wait($status);
+if($conn !== false) { fclose($conn); }
+fclose($server);
+@unlink($p_socket);
 
 ?>
\ No newline at end of file
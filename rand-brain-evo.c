@@ -1,11 +1,21 @@
+#define _GNU_SOURCE // for pthread_setaffinity_np
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
-#include <signal.h>
 #include <unistd.h>
 #include <time.h>
-// include <pthread.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 // Configuration
 
@@ -13,7 +23,6 @@
 #define NUM_INPUTS 9
 #define MAX_WEIGHTS 10000
 #define MAX_SUMSIS 1000
-#define MAX_GENES 50000
 
 #define TYPE_VALUE float
 #define TYPE_VALUE_FORMAT "%f"
@@ -23,6 +32,12 @@
 // Grid to evaluate task surfaces
 #define TASK_EVAL_ZOOM 20.
 
+// Look up the signs of task surfaces in a bitmap of 2^TASK_SIGN_MAP_BITS x 2^TASK_SIGN_MAP_BITS cells
+// made once per surface, instead of calculating them (see task_make_sign_map)
+// Making the map costs about as much as calculating a few thousand questions, so it only pays if there are more
+#define TASK_SIGN_MAP 0
+#define TASK_SIGN_MAP_BITS 12
+
 #define INITIAL_LEARNING_RATE .8
 #define INITIAL_THINKING_TIME 40
 #define MIN_THINKING_TIME 12
@@ -36,6 +51,7 @@
 
 // How many to keep for the next generation (at least half)
 #define POOL_KEEP 680
+_Static_assert(POOL_SIZE - POOL_KEEP <= POOL_KEEP + 2, "POOL_KEEP must be at least half of POOL_SIZE");
 
 // How many different tasks to give
 #define TASK_NUM 2
@@ -49,9 +65,44 @@
 // Whether to use a baseline strategy to guess the answers to the questions posed.
 // Yields about 94% (NB learning happens at the same time as the answering)
 #define CALCULATE_BASELINE 0
+// The examples are kept in a grid of BASELINE_GRID x BASELINE_GRID cells to find the closest one
+#define BASELINE_GRID 64
+
+// Whether to use AVX2/AVX-512 kernels for thinking when the CPU supports them (needs TYPE_VALUE float)
+#define USE_SIMD 1
 
 // Configuration ends
 
+#if USE_SIMD && defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define SIMD_X86 1
+#else
+#define SIMD_X86 0
+#endif
+_Static_assert(!SIMD_X86 || sizeof(TYPE_VALUE) == sizeof(float), "USE_SIMD needs TYPE_VALUE float");
+
+// Number of sumsis summed side by side in the sliced layout used by the SIMD kernels
+#define SIMD_SLICE 16
+
+// Commands between the snapshots of the construction state kept for rebuilding brains
+#define BRAIN_SNAPSHOT_INTERVAL 32
+
+// Maximum number of threads (--threads)
+#define MAX_THREADS 256
+
+// Leave the units that cannot affect the output out of the compiled brains
+#define PRUNE_DEAD_UNITS 1
+
+// Racing (--racing): at checkpoints, brains whose optimistic final score is below the estimated
+// keep limit stop answering questions, and get a pessimistic estimate as their score (see race_check)
+#define RACING_CHECKPOINT (STEPS / 8) // questions between checkpoints
+#define RACING_PRESCREEN (STEPS / 12) // new brains are checked after this many questions of the first task too
+#define RACING_Z 2. // width of the confidence bounds in standard deviations
+
+// Brains with identical genes are evaluated once and share the result, with the noise of the first one.
+// Set to 1 to give each of them its own noise instead (then they are all evaluated)
+#define DEDUP_OWN_NOISE 0
+
 // Commands are used to construct a network and form the gene sequences / threads
 #define CMD_NEW_WEIGHT 901
 #define CMD_NEW_SUMSI 902
@@ -84,17 +135,9 @@
 #define TYPE_SUMSI_OUT 804
 #define TYPE_GLOBAL_IN 805
 
-#define XPOL_NOOP 700
-#define XPOL_DOWNLOAD 701
-#define XPOL_DOWNLOAD_READY 702
-#define XPOL_UPLOAD 703
-int xpol_state = XPOL_NOOP;
-pid_t xpol_target_pid = -1;
-
 // TODO add export/import from other pools
 // TODO track the age of brains
 // TODO Use double?
-// TODO Allocate memory for brains instead of static lists
 // TODO sanity check brain after creation (e.g. inputs and outputs are connected)
 
 
@@ -104,14 +147,67 @@ void die(char *message) {
 }
 
 
-// Returns a random number between 0 and 1
-TYPE_VALUE getrand() {
-    return ((TYPE_VALUE)random()) / ((TYPE_VALUE)RAND_MAX);
+// ==== RANDOM ===================================================================================================================
+// Counter-based random streams (SplitMix style). Each stream is keyed by the seed, the purpose,
+// the generation and an index (usually a brain), so streams do not depend on each other
+// and a run with a given seed is the same whatever order or thread things are done in.
+
+#define RNG_INIT 601 // creating the initial gene pool; index: brain
+#define RNG_TASK 602 // task surface and questions; index: task
+#define RNG_PLAY 603 // noise in brain_play_init; index: task * POOL_SIZE + brain
+#define RNG_PENALTY 604 // noise in the penalty; index: brain
+#define RNG_BREED 605 // mutating and creating a brain; index: target brain
+#define RNG_CROSSOVER 606 // choosing and performing the crossover; index: 0
+#define RNG_MIGRATE 607 // choosing the island to send migrants to; index: island
+
+// Each island has its own seed (see ISLANDS), which the worker threads take over in each job (see threads_main)
+__thread uint64_t rng_seed = 0;
+
+struct rng_t {
+    uint64_t key;
+    uint64_t counter;
+};
+
+
+// Mix the bits of a number (the SplitMix64 finaliser)
+uint64_t rng_mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+// Initialise a stream
+void rng_init(struct rng_t *rng, int purpose, int64_t generation, int64_t index) {
+    uint64_t key = rng_mix(rng_seed + 0x9E3779B97F4A7C15ULL * (uint64_t)purpose);
+    key = rng_mix(key + 0x9E3779B97F4A7C15ULL * (uint64_t)generation);
+    rng->key = rng_mix(key + 0x9E3779B97F4A7C15ULL * (uint64_t)index);
+    rng->counter = 0;
+}
+
+
+// Returns the next 64 random bits from a stream
+uint64_t rng_next(struct rng_t *rng) {
+    rng->counter++;
+    return rng_mix(rng_mix(rng->counter * 0x9E3779B97F4A7C15ULL) ^ rng->key);
 }
 
 
-int getrand_location(const int length) {
-    return (int)(getrand() * (length + 1));
+// Returns a random number between 0 and 1 (excluding 1)
+TYPE_VALUE getrand(struct rng_t *rng) {
+    if(sizeof(TYPE_VALUE) == sizeof(float)) { return (TYPE_VALUE)(rng_next(rng) >> 40) * (TYPE_VALUE)0x1.0p-24; }
+    return (TYPE_VALUE)(rng_next(rng) >> 11) * (TYPE_VALUE)0x1.0p-53;
+}
+
+
+// Move a stream so that the next number is the same as the (n+1)th number after rng_init
+void rng_seek(struct rng_t *rng, uint64_t n) {
+    rng->counter = n;
+}
+
+
+int getrand_location(struct rng_t *rng, const int length) {
+    return (int)(getrand(rng) * (length + 1));
 }
 
 
@@ -125,9 +221,243 @@ void write_debug_file(char *msg) {
     */
 }
 
+// ==== THREADS ==================================================================================================================
+// A persistent pool of worker threads. The calling thread takes part in every job as thread 0
+// Each island has its own pool
+
+struct threads_worker_t {
+    struct threads_t *pool;
+    int ix;
+};
+
+struct threads_t {
+    int num; // including the main thread
+    int first_cpu; // the threads are pinned to CPUs from this one, or -1
+    uint64_t rng_seed; // of the thread running the job
+    pthread_t threads[MAX_THREADS];
+    struct threads_worker_t workers[MAX_THREADS];
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    int round; // incremented when a new job starts
+    int running; // number of workers still working on the job
+    void (*job)(void *arg, int thread_ix);
+    void *job_arg;
+};
+
+__thread struct threads_t threads = { .num = 1 };
+
+
+// Pin the calling thread to a CPU
+void threads_pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % sysconf(_SC_NPROCESSORS_ONLN), &set);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) { fprintf(stderr, "Cannot pin thread to CPU %d\n", cpu); }
+}
+
+
+void *threads_main(void *arg) {
+    struct threads_t *pool = ((struct threads_worker_t *)arg)->pool;
+    int thread_ix = ((struct threads_worker_t *)arg)->ix;
+    int round = 0;
+    
+    if(pool->first_cpu >= 0) { threads_pin(pool->first_cpu + thread_ix); }
+    pthread_mutex_lock(&pool->mutex);
+    while(1) {
+        while(pool->round == round) { pthread_cond_wait(&pool->start_cond, &pool->mutex); }
+        round = pool->round;
+        rng_seed = pool->rng_seed;
+        pthread_mutex_unlock(&pool->mutex);
+        
+        pool->job(pool->job_arg, thread_ix);
+        
+        pthread_mutex_lock(&pool->mutex);
+        pool->running--;
+        if(pool->running == 0) { pthread_cond_signal(&pool->done_cond); }
+    }
+    return NULL;
+}
+
+
+// Start the worker threads of the calling thread, pinning them and the calling thread to CPUs
+// first_cpu..first_cpu+num-1 unless first_cpu is -1
+void threads_init(int num, int first_cpu) {
+    if(num < 1 || num > MAX_THREADS) { die("Wrong number of threads"); }
+    threads.num = num;
+    threads.first_cpu = first_cpu;
+    threads.round = 0;
+    threads.running = 0;
+    if(pthread_mutex_init(&threads.mutex, NULL) != 0) { die("Cannot create mutex"); }
+    if(pthread_cond_init(&threads.start_cond, NULL) != 0) { die("Cannot create condition"); }
+    if(pthread_cond_init(&threads.done_cond, NULL) != 0) { die("Cannot create condition"); }
+    if(first_cpu >= 0) { threads_pin(first_cpu); }
+    for(int i=1; i<num; i++) {
+        threads.workers[i].pool = &threads;
+        threads.workers[i].ix = i;
+        if(pthread_create(&threads.threads[i], NULL, threads_main, &threads.workers[i]) != 0) { die("Cannot create thread"); }
+    }
+    fprintf(stderr, "Threads: %d\n", num);
+}
+
+
+// Run job(arg, thread_ix) on all threads and wait until all of them return
+void threads_run(void (*job)(void *arg, int thread_ix), void *arg) {
+    if(threads.num == 1) {
+        job(arg, 0);
+        return;
+    }
+    pthread_mutex_lock(&threads.mutex);
+    threads.job = job;
+    threads.job_arg = arg;
+    threads.rng_seed = rng_seed;
+    threads.running = threads.num - 1;
+    threads.round++;
+    pthread_cond_broadcast(&threads.start_cond);
+    pthread_mutex_unlock(&threads.mutex);
+    
+    job(arg, 0);
+    
+    pthread_mutex_lock(&threads.mutex);
+    while(threads.running > 0) { pthread_cond_wait(&threads.done_cond, &threads.mutex); }
+    pthread_mutex_unlock(&threads.mutex);
+}
+
+
+// Take the next chunk of work items from a shared counter
+// Returns the first item of the chunk
+int threads_take(int *counter, int chunk) {
+    return __atomic_fetch_add(counter, chunk, __ATOMIC_RELAXED);
+}
+
+// ==== ARENA ====================================================================================================================
+// Memory for brains and genes. Blocks are rounded up to a power of two and freed blocks are kept on
+// free lists by size, so rebuilding brains reuses memory instead of going back to malloc
+
+#define ARENA_CHUNK (1 << 22) // bytes taken from the system at a time
+#define ARENA_MIN_CLASS 6 // smallest block is 64 bytes, which is also the alignment of all blocks
+#define ARENA_CLASSES 48
+
+struct arena_t {
+    pthread_mutex_t mutex;
+    char *chunk; // blocks are cut from here
+    size_t chunk_used;
+    void *free_list[ARENA_CLASSES]; // freed blocks linked through their first word
+    size_t reserved; // bytes taken from the system (stats)
+    size_t used; // bytes in blocks given out (stats)
+};
+
+struct arena_t brain_arena = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+struct arena_t genes_arena = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+
+// Returns the size class of a block
+int arena_class(size_t size) {
+    int c = ARENA_MIN_CLASS;
+    while(((size_t)1 << c) < size) { c++; }
+    if(c >= ARENA_CLASSES) { die("Arena block too large"); }
+    return c;
+}
+
+
+// Allocate a block of at least size bytes
+// Returns the real size of the block in block_size
+void *arena_alloc(struct arena_t *arena, size_t size, size_t *block_size) {
+    int c = arena_class(size);
+    void *block;
+    
+    *block_size = (size_t)1 << c;
+    pthread_mutex_lock(&arena->mutex);
+    arena->used += *block_size;
+    if(arena->free_list[c] != NULL) {
+        block = arena->free_list[c];
+        arena->free_list[c] = *(void**)block;
+    }
+    else if(*block_size > ARENA_CHUNK / 4) {
+        block = aligned_alloc((size_t)1 << ARENA_MIN_CLASS, *block_size);
+        if(block == NULL) { die("Out of memory"); }
+        arena->reserved += *block_size;
+    }
+    else {
+        if(arena->chunk == NULL || arena->chunk_used + *block_size > ARENA_CHUNK) {
+            // The rest of the old chunk is lost, but that is at most a quarter of it
+            arena->chunk = aligned_alloc((size_t)1 << ARENA_MIN_CLASS, ARENA_CHUNK);
+            if(arena->chunk == NULL) { die("Out of memory"); }
+            arena->chunk_used = 0;
+            arena->reserved += ARENA_CHUNK;
+        }
+        block = arena->chunk + arena->chunk_used;
+        arena->chunk_used += *block_size;
+    }
+    pthread_mutex_unlock(&arena->mutex);
+    return block;
+}
+
+
+// Log the memory used (other islands may be allocating at the same time)
+void arena_log(const char *name, struct arena_t *arena) {
+    pthread_mutex_lock(&arena->mutex);
+    size_t used = arena->used, reserved = arena->reserved;
+    pthread_mutex_unlock(&arena->mutex);
+    fprintf(stderr, "%s memory: %.1f MB (%.1f MB reserved)\n", name, used / 1048576., reserved / 1048576.);
+}
+
+
+// Return a block of block_size bytes (as returned by arena_alloc)
+void arena_free(struct arena_t *arena, void *block, size_t block_size) {
+    if(block == NULL) { return; }
+    int c = arena_class(block_size);
+    pthread_mutex_lock(&arena->mutex);
+    arena->used -= block_size;
+    *(void**)block = arena->free_list[c];
+    arena->free_list[c] = block;
+    pthread_mutex_unlock(&arena->mutex);
+}
+
 // ==== BRAIN ====================================================================================================================
 
-struct brain_t {
+// Scalar construction state before a command
+struct brain_snapshot_t {
+    int log_num; // entries in the undo log at this point
+    int weight_stack_ix;
+    int weight_num;
+    int weight_current;
+    int sumsi_stack_ix;
+    int sumsi_num;
+    int sumsi_current;
+    int output_conn;
+};
+
+
+// How a brain was constructed, so that a brain with genes that only differ after some point
+// can continue from there instead of processing all the genes (see brain_constr_resume)
+struct brain_record_t {
+    // Snapshots before commands 0, BRAIN_SNAPSHOT_INTERVAL, 2*BRAIN_SNAPSHOT_INTERVAL, ...
+    struct brain_snapshot_t *snapshots;
+    int snapshot_num;
+    int snapshot_size;
+    // Undo log of the writes into the tables: offset of the int in struct brain_constr_t, old value
+    int (*log)[2];
+    int log_num;
+    int log_size;
+    // The tables at the end of the construction
+    int weight_num;
+    int weight_size;
+    int (*weight_conn)[W_PIN__NUM];
+    TYPE_VALUE *initial_weights;
+    int weight_stack_num;
+    int weight_stack_size;
+    int *weight_stack;
+    int sumsi_stack_num;
+    int sumsi_stack_size;
+    int *sumsi_stack;
+    int input_conn[NUM_INPUTS];
+};
+
+
+// Construction state of a brain. This is only needed while a brain is created from genes,
+// so every thread has one that it reuses (see brain_constr_scratch)
+struct brain_constr_t {
     // Weight units have two inputs (input, control) and one output
     // We have a stack of weights for construction
     int weight_stack[MAX_WEIGHTS]; // IDs
@@ -142,6 +472,10 @@ struct brain_t {
     int sumsi_num;
     int sumsi_current; // ID
     
+    // Number of stack entries that have been used
+    int weight_stack_num;
+    int sumsi_stack_num;
+    
     // Outgoing connections from a weight unit
     // weight_conn[i][W_PIN_OUT] -- which whatever the output is going to
     // weight_conn[i][W_PIN_OUT_TYPE] -- whether the output is connected to a TYPE_WEIGHT_CTRL or a TYPE_SUMSI_IN
@@ -149,6 +483,7 @@ struct brain_t {
     // weight_conn[i][W_PIN_IN_TYPE] -- whether it is TYPE_GLOBAL_IN or TYPE_SUMSI_OUT
     // weight_conn[i][W_PIN_CTRL] -- which whatever the control is coming from
     // weight_conn[i][W_PIN_CTRL_TYPE] -- whether it is TYPE_WEIGHT_OUT or TYPE_SUMSI_OUT
+    // Rows are cleared when a weight is created
     int weight_conn[MAX_WEIGHTS][W_PIN__NUM];
     
     // Which weights are inputs connected to? (For sanity checking)
@@ -160,21 +495,108 @@ struct brain_t {
     TYPE_VALUE learning_rate;
     int thinking_time;
     TYPE_VALUE initial_weights[MAX_WEIGHTS];
-    TYPE_VALUE weights[MAX_WEIGHTS];
+    
+    // Where to record the construction (see brain_constr_set)
+    struct brain_record_t *record;
+    
+    // Work space for brain_find_live and brain_compile
+    int live_weight[MAX_WEIGHTS];
+    int live_sumsi[MAX_SUMSIS];
+    int sumsi_in_start[MAX_SUMSIS + 1];
+    int sumsi_in_weight[MAX_WEIGHTS];
+    int live_stack[MAX_WEIGHTS + MAX_SUMSIS];
+    int out_count[MAX_SUMSIS];
+    int degree[MAX_SUMSIS][2];
+};
+
+
+// A brain ready for thinking and learning
+// The arrays are packed into one block from brain_arena sized to the brain, with the data used
+// in every step first, so that a whole brain can stay in the cache (see brain_layout)
+struct brain_t {
+    int weight_num; // weight IDs are 1..weight_num-1; 0 means unconnected
+    int sumsi_num; // sumsi IDs are 1..sumsi_num-1
+    int output_conn; // which sumsi does the output come from?
+    TYPE_VALUE learning_rate;
+    int thinking_time;
     
     // For internal calculations
-    TYPE_VALUE weight_state[MAX_WEIGHTS];
-    TYPE_VALUE sumsi_state[MAX_SUMSIS];
+    TYPE_VALUE *weights; // [weight_num]
+    TYPE_VALUE *weight_state; // [weight_num]
+    TYPE_VALUE *sumsi_state; // [sumsi_num]
+    
+    // Compiled connections used when thinking (see brain_compile)
+    // Weights whose input is a global input or a sumsi output: in_*_weight[k] <- in_*_src[k]
+    int in_global_num;
+    int *in_global_weight;
+    int *in_global_src;
+    int in_sumsi_num;
+    int *in_sumsi_weight;
+    int *in_sumsi_src;
+    // Weight to sumsi edges grouped by target sumsi (for the scalar kernel):
+    // sumsi out_target[t] sums the weights out_weight[out_start[t]..out_start[t+1]-1]
+    int out_target_num;
+    int out_edge_num;
+    int *out_target;
+    int *out_start;
+    int *out_weight;
+    // The same edges in slices of SIMD_SLICE targets (for the SIMD kernels):
+    // slice b sums into out_slice_target[b*SIMD_SLICE+lane] the weights at
+    // out_slice_weight[out_slice_start[b] + j*SIMD_SLICE + lane] for j < out_slice_len[b]
+    int out_slice_num;
+    int out_slice_size;
+    int *out_slice_target;
+    int *out_slice_start;
+    int *out_slice_len;
+    int *out_slice_weight;
+    // Control edges from a weight output or a sumsi output: ctrl_*_weight[k] <- ctrl_*_src[k]
+    int ctrl_weight_num;
+    int *ctrl_weight_weight;
+    int *ctrl_weight_src;
+    int ctrl_sumsi_num;
+    int *ctrl_sumsi_weight;
+    int *ctrl_sumsi_src;
+    
+    TYPE_VALUE *initial_weights; // [weight_num]
+    int *weight_origin; // [weight_num] the ID of each weight in the construction
+    
+    // Number of units before pruning (see brain_find_live)
+    int constr_weight_num;
+    int constr_sumsi_num;
+    
+    void *mem; // the block holding the arrays
+    size_t mem_size;
+    
+    struct brain_record_t record; // how the brain was constructed
 };
 
+// Whether brains need the sliced layout (set by brain_select_kernels)
+int brain_use_slices = 0;
+
 
 struct brain_t *brain_alloc(int count) {
     struct brain_t *brain = malloc(count * sizeof(struct brain_t));
     if(brain == NULL) { die("Out of memory"); }
+    for(int i=0; i<count; i++) {
+        brain[i].mem = NULL;
+        brain[i].mem_size = 0;
+        memset(&brain[i].record, 0, sizeof(struct brain_record_t));
+    }
     return brain;
 }
 
 
+// Returns the construction state of the current thread
+struct brain_constr_t *brain_constr_scratch(void) {
+    static __thread struct brain_constr_t *scratch = NULL;
+    if(scratch == NULL) {
+        scratch = malloc(sizeof(struct brain_constr_t));
+        if(scratch == NULL) { die("Out of memory"); }
+    }
+    return scratch;
+}
+
+
 // Implements the nonlinearity that sumsis use
 TYPE_VALUE nonlinearity(TYPE_VALUE x) {
     return (x < 0 ? x / 10. : x);
@@ -182,110 +604,225 @@ TYPE_VALUE nonlinearity(TYPE_VALUE x) {
 
 
 // Initialise a brain for construction
-void brain_constr_init(struct brain_t *brain) {
+void brain_constr_init(struct brain_constr_t *constr) {
     int i, j;
     
-    brain->weight_current = 1;
-    brain->weight_stack[0] = 0; // start with 1 so 0 can mean unconnected
-    brain->weight_stack[1] = 1; // start with 1 so 0 can mean unconnected
-    brain->initial_weights[1] = .5;
-    brain->weight_stack_ix = 1;
-    brain->weight_num = 2;
+    constr->weight_current = 1;
+    constr->weight_stack[0] = 0; // start with 1 so 0 can mean unconnected
+    constr->weight_stack[1] = 1; // start with 1 so 0 can mean unconnected
+    constr->initial_weights[0] = 0;
+    constr->initial_weights[1] = .5;
+    constr->weight_stack_ix = 1;
+    constr->weight_num = 2;
+    constr->weight_stack_num = 2;
+    
+    constr->sumsi_current = 1;
+    constr->sumsi_stack[0] = 0; // start with 1 so 0 can mean unconnected
+    constr->sumsi_stack[1] = 1; // start with 1 so 0 can mean unconnected
+    constr->sumsi_stack_ix = 1;
+    constr->sumsi_num = 2;
+    constr->sumsi_stack_num = 2;
+    
+    for(i=0; i<NUM_INPUTS; i++) { constr->input_conn[i] = 0; } // unconnected
+    constr->output_conn = 0;
+    for(i=0; i<2; i++) for(j=0; j<W_PIN__NUM; j++) constr->weight_conn[i][j] = 0;
+    constr->learning_rate = INITIAL_LEARNING_RATE; // this is not relevant as overridden by (default) values in genes
+    constr->thinking_time = INITIAL_THINKING_TIME; // this is not relevant as overridden by (default) values in genes
+    constr->record = NULL;
+}
+
+
+// Make room for need items in an array that grows
+void *brain_record_grow(void *array, int *size, int need, size_t item_size) {
+    if(need <= *size) { return array; }
+    *size = (need > *size * 2 ? need : *size * 2);
+    array = realloc(array, *size * item_size);
+    if(array == NULL) { die("Out of memory"); }
+    return array;
+}
+
+
+// Write a cell of the construction tables, logging the old value in the record
+static inline void brain_constr_set(struct brain_constr_t *constr, int *cell, int value) {
+    struct brain_record_t *record = constr->record;
+    if(record != NULL) {
+        record->log = brain_record_grow(record->log, &record->log_size, record->log_num + 1, sizeof(record->log[0]));
+        record->log[record->log_num][0] = (char*)cell - (char*)constr;
+        record->log[record->log_num][1] = *cell;
+        record->log_num++;
+    }
+    *cell = value;
+}
+
+
+// Record a snapshot of the construction state (before command record->snapshot_num * BRAIN_SNAPSHOT_INTERVAL)
+void brain_record_snapshot(const struct brain_constr_t *constr, struct brain_record_t *record) {
+    record->snapshots = brain_record_grow(record->snapshots, &record->snapshot_size, record->snapshot_num + 1, sizeof(struct brain_snapshot_t));
+    struct brain_snapshot_t *snapshot = &record->snapshots[record->snapshot_num];
+    snapshot->log_num = record->log_num;
+    snapshot->weight_stack_ix = constr->weight_stack_ix;
+    snapshot->weight_num = constr->weight_num;
+    snapshot->weight_current = constr->weight_current;
+    snapshot->sumsi_stack_ix = constr->sumsi_stack_ix;
+    snapshot->sumsi_num = constr->sumsi_num;
+    snapshot->sumsi_current = constr->sumsi_current;
+    snapshot->output_conn = constr->output_conn;
+    record->snapshot_num++;
+}
+
+
+// Save the tables at the end of the construction into the record
+void brain_record_save(const struct brain_constr_t *constr, struct brain_record_t *record) {
+    int n;
+    
+    n = constr->weight_num;
+    if(n > record->weight_size) {
+        record->weight_size = n * 2;
+        free(record->weight_conn);
+        free(record->initial_weights);
+        record->weight_conn = malloc(record->weight_size * sizeof(record->weight_conn[0]));
+        record->initial_weights = malloc(record->weight_size * sizeof(TYPE_VALUE));
+        if(record->weight_conn == NULL || record->initial_weights == NULL) { die("Out of memory"); }
+    }
+    record->weight_num = n;
+    memcpy(record->weight_conn, constr->weight_conn, n * sizeof(record->weight_conn[0]));
+    memcpy(record->initial_weights, constr->initial_weights, n * sizeof(TYPE_VALUE));
+    
+    record->weight_stack_num = constr->weight_stack_num;
+    record->weight_stack = brain_record_grow(record->weight_stack, &record->weight_stack_size, constr->weight_stack_num, sizeof(int));
+    memcpy(record->weight_stack, constr->weight_stack, constr->weight_stack_num * sizeof(int));
+    record->sumsi_stack_num = constr->sumsi_stack_num;
+    record->sumsi_stack = brain_record_grow(record->sumsi_stack, &record->sumsi_stack_size, constr->sumsi_stack_num, sizeof(int));
+    memcpy(record->sumsi_stack, constr->sumsi_stack, constr->sumsi_stack_num * sizeof(int));
+    memcpy(record->input_conn, constr->input_conn, sizeof(record->input_conn));
+}
+
+
+// Put the construction state back to where it was at snapshot k of the base record, and continue
+// recording into record (which can be the base record itself).
+// Only the cells written after the snapshot are touched: the tables at the end are loaded and the
+// writes after the snapshot are undone. Rows of weights created after the snapshot are cleared
+// again when those weights are created.
+void brain_constr_resume(struct brain_constr_t *constr, const struct brain_record_t *base, int k, struct brain_record_t *record) {
+    const struct brain_snapshot_t *snapshot = &base->snapshots[k];
+    int i;
+    
+    memcpy(constr->weight_conn, base->weight_conn, base->weight_num * sizeof(base->weight_conn[0]));
+    memcpy(constr->initial_weights, base->initial_weights, base->weight_num * sizeof(TYPE_VALUE));
+    memcpy(constr->weight_stack, base->weight_stack, base->weight_stack_num * sizeof(int));
+    memcpy(constr->sumsi_stack, base->sumsi_stack, base->sumsi_stack_num * sizeof(int));
+    memcpy(constr->input_conn, base->input_conn, sizeof(constr->input_conn));
+    constr->weight_stack_num = base->weight_stack_num;
+    constr->sumsi_stack_num = base->sumsi_stack_num;
+    
+    for(i=base->log_num-1; i>=snapshot->log_num; i--) {
+        *(int*)((char*)constr + base->log[i][0]) = base->log[i][1];
+    }
     
-    brain->sumsi_current = 1;
-    brain->sumsi_stack[0] = 0; // start with 1 so 0 can mean unconnected
-    brain->sumsi_stack[1] = 1; // start with 1 so 0 can mean unconnected
-    brain->sumsi_stack_ix = 1;
-    brain->sumsi_num = 2;
+    constr->weight_stack_ix = snapshot->weight_stack_ix;
+    constr->weight_num = snapshot->weight_num;
+    constr->weight_current = snapshot->weight_current;
+    constr->sumsi_stack_ix = snapshot->sumsi_stack_ix;
+    constr->sumsi_num = snapshot->sumsi_num;
+    constr->sumsi_current = snapshot->sumsi_current;
+    constr->output_conn = snapshot->output_conn;
     
-    for(i=0; i<NUM_INPUTS; i++) { brain->input_conn[i] = 0; } // unconnected
-    brain->output_conn = 0;
-    for(i=0; i<MAX_WEIGHTS; i++) for(j=0; j<W_PIN__NUM; j++) brain->weight_conn[i][j] = 0;
-    brain->learning_rate = INITIAL_LEARNING_RATE; // this is not relevant as overridden by (default) values in genes
-    brain->thinking_time = INITIAL_THINKING_TIME; // this is not relevant as overridden by (default) values in genes
+    // Keep the part of the record before the snapshot. The snapshot itself is taken again
+    if(record != base) {
+        record->log = brain_record_grow(record->log, &record->log_size, snapshot->log_num, sizeof(record->log[0]));
+        memcpy(record->log, base->log, snapshot->log_num * sizeof(record->log[0]));
+        record->snapshots = brain_record_grow(record->snapshots, &record->snapshot_size, k, sizeof(struct brain_snapshot_t));
+        memcpy(record->snapshots, base->snapshots, k * sizeof(struct brain_snapshot_t));
+    }
+    record->log_num = snapshot->log_num;
+    record->snapshot_num = k;
+    constr->record = record;
 }
 
 
 // Construction: process a command in the gene sequence
 // Returns success
-int brain_constr_process_command(struct brain_t *brain, int command, int ix) {
+int brain_constr_process_command(struct brain_constr_t *constr, int command, int ix) {
     int p;
 
     switch(command) {
         case CMD_NEW_WEIGHT: // create new weight unit and push. ix is the initial weight (ix/100)
-            brain->weight_num++;
-            if(brain->weight_num >= MAX_WEIGHTS) { fprintf(stderr, "Too many weights\n"); return 0; }
-            brain->weight_stack_ix++;
-            if(brain->weight_stack_ix >= MAX_WEIGHTS) { fprintf(stderr, "Too many weights (stack)\n"); return 0; }
-            brain->weight_current = brain->weight_num - 1;
-            brain->weight_stack[brain->weight_stack_ix] = brain->weight_current;
-            brain->initial_weights[brain->weight_current] = ((TYPE_VALUE)ix) / 100;
+            constr->weight_num++;
+            if(constr->weight_num >= MAX_WEIGHTS) { fprintf(stderr, "Too many weights\n"); return 0; }
+            constr->weight_stack_ix++;
+            if(constr->weight_stack_ix >= MAX_WEIGHTS) { fprintf(stderr, "Too many weights (stack)\n"); return 0; }
+            constr->weight_current = constr->weight_num - 1;
+            brain_constr_set(constr, &constr->weight_stack[constr->weight_stack_ix], constr->weight_current);
+            if(constr->weight_stack_ix >= constr->weight_stack_num) { constr->weight_stack_num = constr->weight_stack_ix + 1; }
+            for(p=0; p<W_PIN__NUM; p++) { constr->weight_conn[constr->weight_current][p] = 0; } // not logged as the weight is new
+            constr->initial_weights[constr->weight_current] = ((TYPE_VALUE)ix) / 100;
             break;
         case CMD_NEW_SUMSI: // create new sumsi unit and push
-            brain->sumsi_num++;
-            if(brain->sumsi_num >= MAX_SUMSIS) { fprintf(stderr, "Too many sumsis\n"); return 0; }
-            brain->sumsi_stack_ix++;
-            if(brain->sumsi_stack_ix >= MAX_SUMSIS) { fprintf(stderr, "Too many sumsis (stack)\n"); return 0; }
-            brain->sumsi_current = brain->sumsi_num - 1;
-            brain->sumsi_stack[brain->sumsi_stack_ix] = brain->sumsi_current;
+            constr->sumsi_num++;
+            if(constr->sumsi_num >= MAX_SUMSIS) { fprintf(stderr, "Too many sumsis\n"); return 0; }
+            constr->sumsi_stack_ix++;
+            if(constr->sumsi_stack_ix >= MAX_SUMSIS) { fprintf(stderr, "Too many sumsis (stack)\n"); return 0; }
+            constr->sumsi_current = constr->sumsi_num - 1;
+            brain_constr_set(constr, &constr->sumsi_stack[constr->sumsi_stack_ix], constr->sumsi_current);
+            if(constr->sumsi_stack_ix >= constr->sumsi_stack_num) { constr->sumsi_stack_num = constr->sumsi_stack_ix + 1; }
             break;
         case CMD_SUMSI_TO_WEIGHT_IN: // connect latest sumsi.out to weight[-ix].in
             // TODO Allow override?
-            p = brain->weight_stack_ix - ix;
-            if(p >= 1) { p = brain->weight_stack[p]; }
+            p = constr->weight_stack_ix - ix;
+            if(p >= 1) { p = constr->weight_stack[p]; }
             if(p >= 1) {
-                brain->weight_conn[p][W_PIN_IN_TYPE] = TYPE_SUMSI_OUT;
-                brain->weight_conn[p][W_PIN_IN] = brain->sumsi_current;
+                brain_constr_set(constr, &constr->weight_conn[p][W_PIN_IN_TYPE], TYPE_SUMSI_OUT);
+                brain_constr_set(constr, &constr->weight_conn[p][W_PIN_IN], constr->sumsi_current);
             }
             break;
         case CMD_SUMSI_TO_WEIGHT_CTRL: // connect latest sumsi.out to weight[-ix].ctrl 
             // TODO Allow override?
-            p = brain->weight_stack_ix - ix;
-            if(p >= 1) { p = brain->weight_stack[p]; }
+            p = constr->weight_stack_ix - ix;
+            if(p >= 1) { p = constr->weight_stack[p]; }
             if(p >= 1) {
-                brain->weight_conn[p][W_PIN_CTRL_TYPE] = TYPE_SUMSI_OUT;
-                brain->weight_conn[p][W_PIN_CTRL] = brain->sumsi_current;
+                brain_constr_set(constr, &constr->weight_conn[p][W_PIN_CTRL_TYPE], TYPE_SUMSI_OUT);
+                brain_constr_set(constr, &constr->weight_conn[p][W_PIN_CTRL], constr->sumsi_current);
             }
             break;     
         case CMD_WEIGHT_TO_SUMSI_IN: // connect latest weight.out to sumsi[-ix].in
             // TODO Allow override?
-            p = brain->sumsi_stack_ix - ix;
-            if(p >= 1) { p = brain->sumsi_stack[p]; }
+            p = constr->sumsi_stack_ix - ix;
+            if(p >= 1) { p = constr->sumsi_stack[p]; }
             if(p >= 1) {
-                brain->weight_conn[brain->weight_current][W_PIN_OUT_TYPE] = TYPE_SUMSI_IN;
-                brain->weight_conn[brain->weight_current][W_PIN_OUT] = p;
+                brain_constr_set(constr, &constr->weight_conn[constr->weight_current][W_PIN_OUT_TYPE], TYPE_SUMSI_IN);
+                brain_constr_set(constr, &constr->weight_conn[constr->weight_current][W_PIN_OUT], p);
             }
             break;
         case CMD_WEIGHT_TO_WEIGHT_CTRL: // connect latest weight.out to weight[-ix].ctrl
             // TODO Allow override?
-            p = brain->weight_stack_ix - ix;
-            if(p >= 1) { p = brain->weight_stack[p]; }
+            p = constr->weight_stack_ix - ix;
+            if(p >= 1) { p = constr->weight_stack[p]; }
             if(p >= 1) {
-                brain->weight_conn[brain->weight_current][W_PIN_OUT_TYPE] = TYPE_WEIGHT_CTRL;
-                brain->weight_conn[brain->weight_current][W_PIN_OUT] = p;
-                brain->weight_conn[p][W_PIN_CTRL_TYPE] = TYPE_WEIGHT_OUT;
-                brain->weight_conn[p][W_PIN_CTRL] = brain->weight_current;
+                brain_constr_set(constr, &constr->weight_conn[constr->weight_current][W_PIN_OUT_TYPE], TYPE_WEIGHT_CTRL);
+                brain_constr_set(constr, &constr->weight_conn[constr->weight_current][W_PIN_OUT], p);
+                brain_constr_set(constr, &constr->weight_conn[p][W_PIN_CTRL_TYPE], TYPE_WEIGHT_OUT);
+                brain_constr_set(constr, &constr->weight_conn[p][W_PIN_CTRL], constr->weight_current);
             }
             break;        
         case CMD_POP_WEIGHT:
-            if(brain->weight_stack_ix > 1) { 
-                brain->weight_stack_ix--; 
-                brain->weight_current = brain->weight_stack[brain->weight_stack_ix];
+            if(constr->weight_stack_ix > 1) { 
+                constr->weight_stack_ix--; 
+                constr->weight_current = constr->weight_stack[constr->weight_stack_ix];
             }
             break;
         case CMD_POP_SUMSI:
-            if(brain->sumsi_stack_ix > 1) { 
-                brain->sumsi_stack_ix--; 
-                brain->sumsi_current = brain->sumsi_stack[brain->sumsi_stack_ix];
+            if(constr->sumsi_stack_ix > 1) { 
+                constr->sumsi_stack_ix--; 
+                constr->sumsi_current = constr->sumsi_stack[constr->sumsi_stack_ix];
             }
             break;
         case CMD_WEIGHT_TO_INPUT: // Connect the main input[ix] to the latest weight.in
             // TODO Allow override?
             // TODO Allow on non-main thread?
             if(ix < NUM_INPUTS) {
-                brain->weight_conn[brain->weight_current][W_PIN_IN_TYPE] = TYPE_GLOBAL_IN;
-                brain->weight_conn[brain->weight_current][W_PIN_IN] = ix;
-                brain->input_conn[ix] = brain->weight_current;
+                brain_constr_set(constr, &constr->weight_conn[constr->weight_current][W_PIN_IN_TYPE], TYPE_GLOBAL_IN);
+                brain_constr_set(constr, &constr->weight_conn[constr->weight_current][W_PIN_IN], ix);
+                brain_constr_set(constr, &constr->input_conn[ix], constr->weight_current);
             }
             else {
                 fprintf(stderr, "Overindexed input\n");
@@ -295,7 +832,7 @@ int brain_constr_process_command(struct brain_t *brain, int command, int ix) {
         case CMD_SUMSI_TO_OUT: // Connect the latest sumsi.out to the main output
             // TODO Allow override?
             // TODO Allow on non-main thread?
-            brain->output_conn = brain->sumsi_current;
+            constr->output_conn = constr->sumsi_current;
             break;
         default:
             // printf("Command: %d", command);
@@ -306,149 +843,915 @@ int brain_constr_process_command(struct brain_t *brain, int command, int ix) {
 }
 
 
-// Initialise a brain for thinking and learning
-void brain_play_init(struct brain_t *brain) {
-    int i;
-    for(i=0; i<=brain->weight_num; i++) { 
-        brain->weight_state[i] = 0;
-        brain->weights[i] = brain->initial_weights[i] + getrand() / 100.; // a bit of noise
+// Sort (degree, target) pairs by decreasing degree
+static int cmp_degree(const void *p1, const void *p2) { return ((const int*)p2)[0] - ((const int*)p1)[0]; }
+
+
+// Lay out the arrays of a brain in mem, or only return the size needed if mem is NULL
+// The counts in the brain need to be set
+size_t brain_layout(struct brain_t *brain, char *mem) {
+    size_t size = 0;
+#define BRAIN_PART(ptr, type, n) \
+    if(mem != NULL) { brain->ptr = (type*)(mem + size); } \
+    size += ((size_t)(n) * sizeof(type) + 63) & ~(size_t)63;
+    
+    BRAIN_PART(weights, TYPE_VALUE, brain->weight_num)
+    BRAIN_PART(weight_state, TYPE_VALUE, brain->weight_num)
+    BRAIN_PART(sumsi_state, TYPE_VALUE, brain->sumsi_num)
+    BRAIN_PART(in_global_weight, int, brain->in_global_num)
+    BRAIN_PART(in_global_src, int, brain->in_global_num)
+    BRAIN_PART(in_sumsi_weight, int, brain->in_sumsi_num)
+    BRAIN_PART(in_sumsi_src, int, brain->in_sumsi_num)
+    if(brain_use_slices) {
+        BRAIN_PART(out_slice_target, int, brain->out_slice_num * SIMD_SLICE)
+        BRAIN_PART(out_slice_start, int, brain->out_slice_num)
+        BRAIN_PART(out_slice_len, int, brain->out_slice_num)
+        BRAIN_PART(out_slice_weight, int, brain->out_slice_size)
+    }
+    else {
+        BRAIN_PART(out_target, int, brain->out_target_num)
+        BRAIN_PART(out_start, int, brain->out_target_num + 1)
+        BRAIN_PART(out_weight, int, brain->out_edge_num)
     }
-    for(i=0; i<=brain->sumsi_num; i++) { brain->sumsi_state[i] = 0; }
+    BRAIN_PART(ctrl_weight_weight, int, brain->ctrl_weight_num)
+    BRAIN_PART(ctrl_weight_src, int, brain->ctrl_weight_num)
+    BRAIN_PART(ctrl_sumsi_weight, int, brain->ctrl_sumsi_num)
+    BRAIN_PART(ctrl_sumsi_src, int, brain->ctrl_sumsi_num)
+    BRAIN_PART(initial_weights, TYPE_VALUE, brain->weight_num)
+    BRAIN_PART(weight_origin, int, brain->weight_num)
+    
+#undef BRAIN_PART
+    return size;
 }
 
 
-// Perform one step of thinking and learning
-void brain_play_step(struct brain_t *brain, TYPE_VALUE *input_state) {
-    int i, p;
-    TYPE_VALUE ctrl;
-
-    // Update weight states (these will represent the inputs to the weights)
-    for(i=1; i<=brain->weight_num; i++) {
-        p = brain->weight_conn[i][W_PIN_IN];
-        if(p > 0) {
-            switch(brain->weight_conn[i][W_PIN_IN_TYPE]) {
-                case TYPE_GLOBAL_IN:
-                    brain->weight_state[i] = input_state[p];
-                    break;
-                case TYPE_SUMSI_OUT:
-                    brain->weight_state[i] = brain->sumsi_state[p];
-                    break;
-                default:
-                    die("Unknown weight in type");
+// Find the units that can affect the output: the output sumsi, the weights summed into a live sumsi,
+// and the input and control sources of live weights. The others can be left out of the compiled brain.
+// Sets live_weight[i] and live_sumsi[i] to the new ID of each unit, or 0 if it is dead.
+// New IDs keep the order of the units so that sums are still accumulated in the same order.
+void brain_find_live(struct brain_constr_t *constr, int *weight_num, int *sumsi_num) {
+    int i, k, p, u, n;
+    int *live_weight = constr->live_weight;
+    int *live_sumsi = constr->live_sumsi;
+    int *start = constr->sumsi_in_start;
+    int *stack = constr->live_stack;
+    
+    for(i=0; i<constr->weight_num; i++) { live_weight[i] = !PRUNE_DEAD_UNITS; }
+    for(i=0; i<constr->sumsi_num; i++) { live_sumsi[i] = !PRUNE_DEAD_UNITS; }
+    
+    if(PRUNE_DEAD_UNITS) {
+        // The weights summed into each sumsi: sumsi_in_weight[start[p]..start[p+1]-1]
+        for(i=0; i<=constr->sumsi_num; i++) { start[i] = 0; }
+        for(i=1; i<constr->weight_num; i++) {
+            p = constr->weight_conn[i][W_PIN_OUT];
+            if(p > 0 && constr->weight_conn[i][W_PIN_OUT_TYPE] == TYPE_SUMSI_IN) { start[p]++; }
+        }
+        for(i=1; i<=constr->sumsi_num; i++) { start[i] += start[i-1]; }
+        for(i=1; i<constr->weight_num; i++) {
+            p = constr->weight_conn[i][W_PIN_OUT];
+            if(p > 0 && constr->weight_conn[i][W_PIN_OUT_TYPE] == TYPE_SUMSI_IN) { constr->sumsi_in_weight[--start[p]] = i; }
+        }
+        
+        // Walk back from the output. The stack holds weight IDs, and sumsi IDs as negative numbers
+        n = 0;
+        if(constr->output_conn > 0) {
+            live_sumsi[constr->output_conn] = 1;
+            stack[n++] = -constr->output_conn;
+        }
+        while(n > 0) {
+            u = stack[--n];
+            if(u < 0) {
+                for(k=start[-u]; k<start[-u+1]; k++) {
+                    i = constr->sumsi_in_weight[k];
+                    if(!live_weight[i]) { live_weight[i] = 1; stack[n++] = i; }
+                }
+                continue;
+            }
+            p = constr->weight_conn[u][W_PIN_IN];
+            if(p > 0 && constr->weight_conn[u][W_PIN_IN_TYPE] == TYPE_SUMSI_OUT && !live_sumsi[p]) {
+                live_sumsi[p] = 1;
+                stack[n++] = -p;
+            }
+            p = constr->weight_conn[u][W_PIN_CTRL];
+            if(p > 0) {
+                if(constr->weight_conn[u][W_PIN_CTRL_TYPE] == TYPE_WEIGHT_OUT) {
+                    if(!live_weight[p]) { live_weight[p] = 1; stack[n++] = p; }
+                }
+                else if(!live_sumsi[p]) {
+                    live_sumsi[p] = 1;
+                    stack[n++] = -p;
+                }
             }
         }
     }
     
-    // Apply the weights
-    for(i=1; i<=brain->weight_num; i++) {
-        brain->weight_state[i] *= brain->weights[i];
-    }
+    live_weight[0] = 0;
+    *weight_num = 1;
+    for(i=1; i<constr->weight_num; i++) { if(live_weight[i]) { live_weight[i] = (*weight_num)++; } }
+    live_sumsi[0] = 0;
+    *sumsi_num = 1;
+    for(i=1; i<constr->sumsi_num; i++) { if(live_sumsi[i]) { live_sumsi[i] = (*sumsi_num)++; } }
+}
+
+
+// Compile the connection table into typed edge lists so that thinking does not need to dispatch on types
+// Only the units that can affect the output are kept (see brain_find_live)
+// Edges are listed in increasing weight order so that sums are accumulated in the same order as before
+// The brain gets a block from brain_arena sized to the result
+void brain_compile(const struct brain_constr_t *constr, struct brain_t *brain) {
+    int i, p, t, k, b, lane, w;
+    int *out_count = ((struct brain_constr_t*)constr)->out_count;
+    int (*degree)[2] = ((struct brain_constr_t*)constr)->degree;
+    const int *live_weight = constr->live_weight;
+    const int *live_sumsi = constr->live_sumsi;
+    size_t size;
     
+    brain_find_live((struct brain_constr_t*)constr, &brain->weight_num, &brain->sumsi_num);
+    brain->constr_weight_num = constr->weight_num;
+    brain->constr_sumsi_num = constr->sumsi_num;
+    brain->output_conn = live_sumsi[constr->output_conn];
+    brain->learning_rate = constr->learning_rate;
+    brain->thinking_time = constr->thinking_time;
     
-    // Clear the sumsi states
-    for(i=1; i<=brain->sumsi_num; i++) {
-        brain->sumsi_state[i] = 0;
-    }
+    // Count the edges
+    brain->in_global_num = 0;
+    brain->in_sumsi_num = 0;
+    brain->out_edge_num = 0;
+    brain->ctrl_weight_num = 0;
+    brain->ctrl_sumsi_num = 0;
+    for(i=0; i<brain->sumsi_num; i++) { out_count[i] = 0; }
     
-    // Calculate the sums in the sumsis
-    for(i=1; i<=brain->weight_num; i++) {
-        p = brain->weight_conn[i][W_PIN_OUT];
+    for(i=1; i<constr->weight_num; i++) {
+        if(!live_weight[i]) { continue; }
+        
+        p = constr->weight_conn[i][W_PIN_IN];
+        if(p > 0) {
+            switch(constr->weight_conn[i][W_PIN_IN_TYPE]) {
+                case TYPE_GLOBAL_IN: brain->in_global_num++; break;
+                case TYPE_SUMSI_OUT: brain->in_sumsi_num++; break;
+                default: die("Unknown weight in type");
+            }
+        }
+        
+        p = constr->weight_conn[i][W_PIN_OUT];
         if(p > 0) {
-            switch(brain->weight_conn[i][W_PIN_OUT_TYPE]) {
+            switch(constr->weight_conn[i][W_PIN_OUT_TYPE]) {
                 case TYPE_SUMSI_IN:
-                    brain->sumsi_state[p] += brain->weight_state[i];
+                    // A live weight may only be needed for its control output
+                    if(live_sumsi[p]) { out_count[live_sumsi[p]]++; brain->out_edge_num++; }
                     break;
-                case TYPE_WEIGHT_CTRL:
-                    break;
-                default:
-                    die("Unknown weight out type");
+                case TYPE_WEIGHT_CTRL: break;
+                default: die("Unknown weight out type");
+            }
+        }
+        
+        p = constr->weight_conn[i][W_PIN_CTRL];
+        if(p > 0) {
+            switch(constr->weight_conn[i][W_PIN_CTRL_TYPE]) {
+                case TYPE_WEIGHT_OUT: brain->ctrl_weight_num++; break;
+                case TYPE_SUMSI_OUT: brain->ctrl_sumsi_num++; break;
+                default: die("Unknown weight ctrl type");
             }
         }
     }
     
-    // Apply the nonlinearity
-    for(i=1; i<=brain->sumsi_num; i++) {
-        brain->sumsi_state[i] = nonlinearity(brain->sumsi_state[i]);
+    // Targets of the weight to sumsi edges, and the slices.
+    // Targets are sorted by their number of inputs so that the slices need little padding.
+    brain->out_target_num = 0;
+    for(i=1; i<brain->sumsi_num; i++) {
+        if(out_count[i] == 0) { continue; }
+        degree[brain->out_target_num][0] = out_count[i];
+        degree[brain->out_target_num][1] = i;
+        brain->out_target_num++;
+    }
+    brain->out_slice_num = 0;
+    brain->out_slice_size = 0;
+    if(brain_use_slices) {
+        qsort(degree, brain->out_target_num, sizeof(degree[0]), cmp_degree);
+        brain->out_slice_num = (brain->out_target_num + SIMD_SLICE - 1) / SIMD_SLICE;
+        for(b=0; b<brain->out_slice_num; b++) { brain->out_slice_size += degree[b * SIMD_SLICE][0] * SIMD_SLICE; }
     }
     
-    // Learning: apply the control
-    for(i=1; i<=brain->weight_num; i++) {
-        p = brain->weight_conn[i][W_PIN_CTRL];
+    // Get memory
+    size = brain_layout(brain, NULL);
+    if(size > brain->mem_size || size < brain->mem_size / 4) {
+        arena_free(&brain_arena, brain->mem, brain->mem_size);
+        brain->mem = arena_alloc(&brain_arena, size, &brain->mem_size);
+    }
+    brain_layout(brain, brain->mem);
+    
+    brain->initial_weights[0] = 0;
+    brain->weight_origin[0] = 0;
+    for(i=1; i<constr->weight_num; i++) {
+        if(!live_weight[i]) { continue; }
+        brain->initial_weights[live_weight[i]] = constr->initial_weights[i];
+        brain->weight_origin[live_weight[i]] = i;
+    }
+    
+    // Fill the lists
+    brain->in_global_num = 0;
+    brain->in_sumsi_num = 0;
+    brain->ctrl_weight_num = 0;
+    brain->ctrl_sumsi_num = 0;
+    for(i=1; i<constr->weight_num; i++) {
+        w = live_weight[i];
+        if(!w) { continue; }
+        p = constr->weight_conn[i][W_PIN_IN];
         if(p > 0) {
-            switch(brain->weight_conn[i][W_PIN_CTRL_TYPE]) {
-                case TYPE_WEIGHT_OUT:
-                    ctrl = brain->weight_state[p];
-                    break;
-                case TYPE_SUMSI_OUT:
-                    ctrl = brain->sumsi_state[p];
-                    break;
-                default:
-                    die("Unknown weight ctrl type");
+            if(constr->weight_conn[i][W_PIN_IN_TYPE] == TYPE_GLOBAL_IN) {
+                brain->in_global_weight[brain->in_global_num] = w;
+                brain->in_global_src[brain->in_global_num] = p;
+                brain->in_global_num++;
+            }
+            else {
+                brain->in_sumsi_weight[brain->in_sumsi_num] = w;
+                brain->in_sumsi_src[brain->in_sumsi_num] = live_sumsi[p];
+                brain->in_sumsi_num++;
+            }
+        }
+        p = constr->weight_conn[i][W_PIN_CTRL];
+        if(p > 0) {
+            if(constr->weight_conn[i][W_PIN_CTRL_TYPE] == TYPE_WEIGHT_OUT) {
+                brain->ctrl_weight_weight[brain->ctrl_weight_num] = w;
+                brain->ctrl_weight_src[brain->ctrl_weight_num] = live_weight[p];
+                brain->ctrl_weight_num++;
+            }
+            else {
+                brain->ctrl_sumsi_weight[brain->ctrl_sumsi_num] = w;
+                brain->ctrl_sumsi_src[brain->ctrl_sumsi_num] = live_sumsi[p];
+                brain->ctrl_sumsi_num++;
             }
-            brain->weights[i] = ctrl * brain->learning_rate + brain->weights[i] * (1. - brain->learning_rate);
         }
     }
     
+    if(brain_use_slices) {
+        // Where the next input of each sumsi goes in its slice. Padding points to weight 0 whose
+        // state is always zero, and spare lanes sum into sumsi 0 which is never read.
+        k = 0;
+        for(b=0; b<brain->out_slice_num; b++) {
+            brain->out_slice_start[b] = k;
+            brain->out_slice_len[b] = degree[b * SIMD_SLICE][0];
+            for(lane=0; lane<SIMD_SLICE; lane++) {
+                t = b * SIMD_SLICE + lane;
+                brain->out_slice_target[t] = (t < brain->out_target_num ? degree[t][1] : 0);
+                if(t < brain->out_target_num) { out_count[degree[t][1]] = k + lane; }
+            }
+            k += brain->out_slice_len[b] * SIMD_SLICE;
+        }
+        for(k=0; k<brain->out_slice_size; k++) { brain->out_slice_weight[k] = 0; }
+        for(i=1; i<constr->weight_num; i++) {
+            p = constr->weight_conn[i][W_PIN_OUT];
+            if(live_weight[i] && p > 0 && constr->weight_conn[i][W_PIN_OUT_TYPE] == TYPE_SUMSI_IN && live_sumsi[p]) {
+                brain->out_slice_weight[out_count[live_sumsi[p]]] = live_weight[i];
+                out_count[live_sumsi[p]] += SIMD_SLICE;
+            }
+        }
+    }
+    else {
+        // Lay out the sumsi inputs by target. out_count becomes the fill position of each target
+        k = 0;
+        for(t=0; t<brain->out_target_num; t++) {
+            i = degree[t][1];
+            brain->out_target[t] = i;
+            brain->out_start[t] = k;
+            k += out_count[i];
+            out_count[i] = brain->out_start[t];
+        }
+        brain->out_start[brain->out_target_num] = k;
+        for(i=1; i<constr->weight_num; i++) {
+            p = constr->weight_conn[i][W_PIN_OUT];
+            if(live_weight[i] && p > 0 && constr->weight_conn[i][W_PIN_OUT_TYPE] == TYPE_SUMSI_IN && live_sumsi[p]) {
+                brain->out_weight[out_count[live_sumsi[p]]++] = live_weight[i];
+            }
+        }
+    }
 }
 
 
-// Return the output from the brain
-TYPE_VALUE brain_get_output(const struct brain_t *brain) {
-    if(brain->output_conn == 0) { return 0; }
-    return brain->sumsi_state[brain->output_conn];
+// Initialise a brain for thinking and learning
+// rng should be a new stream: the noise of a weight is the number at its construction ID
+void brain_play_init(struct brain_t *brain, struct rng_t *rng) {
+    int i;
+    for(i=0; i<brain->weight_num; i++) { 
+        brain->weight_state[i] = 0;
+        // a bit of noise, which does not depend on which other weights have been pruned
+        rng_seek(rng, brain->weight_origin[i]);
+        brain->weights[i] = brain->initial_weights[i] + getrand(rng) / 100.;
+    }
+    for(i=0; i<brain->sumsi_num; i++) { brain->sumsi_state[i] = 0; }
 }
 
 
-// ==== GENES ====================================================================================================================
-
-struct genes_t {
-    TYPE_VALUE learning_rate;
-    TYPE_VALUE thinking_time;
-    int commands[MAX_GENES];
-    int args[MAX_GENES];
-    int length;
-};
-
+// Perform one step of thinking and learning
+// Only the connections that exist are visited (see brain_compile)
+void brain_play_step_scalar(struct brain_t *brain, TYPE_VALUE *input_state) {
+    int i, k;
+    TYPE_VALUE s;
+    TYPE_VALUE *weight_state = brain->weight_state;
+    TYPE_VALUE *sumsi_state = brain->sumsi_state;
+    TYPE_VALUE *weights = brain->weights;
+    const TYPE_VALUE learning_rate = brain->learning_rate;
 
-struct genes_t *genes_alloc(int count) {
-    struct genes_t *genes = malloc(count * sizeof(struct genes_t));
-    if(genes == NULL) { die("Out of memory"); }
-    return genes;
+    // Update weight states (these will represent the inputs to the weights)
+    // Weights without an input keep their (zero) state
+    for(k=0; k<brain->in_global_num; k++) {
+        weight_state[brain->in_global_weight[k]] = input_state[brain->in_global_src[k]];
+    }
+    for(k=0; k<brain->in_sumsi_num; k++) {
+        weight_state[brain->in_sumsi_weight[k]] = sumsi_state[brain->in_sumsi_src[k]];
+    }
+    
+    // Apply the weights
+    for(i=1; i<brain->weight_num; i++) {
+        weight_state[i] *= weights[i];
+    }
+    
+    // Calculate the sums in the sumsis and apply the nonlinearity
+    // Sumsis without inputs stay at zero
+    for(i=0; i<brain->out_target_num; i++) {
+        s = 0;
+        for(k=brain->out_start[i]; k<brain->out_start[i+1]; k++) {
+            s += weight_state[brain->out_weight[k]];
+        }
+        sumsi_state[brain->out_target[i]] = nonlinearity(s);
+    }
+    
+    // Learning: apply the control
+    for(k=0; k<brain->ctrl_weight_num; k++) {
+        i = brain->ctrl_weight_weight[k];
+        weights[i] = weight_state[brain->ctrl_weight_src[k]] * learning_rate + weights[i] * (1. - learning_rate);
+    }
+    for(k=0; k<brain->ctrl_sumsi_num; k++) {
+        i = brain->ctrl_sumsi_weight[k];
+        weights[i] = sumsi_state[brain->ctrl_sumsi_src[k]] * learning_rate + weights[i] * (1. - learning_rate);
+    }
 }
 
+#if SIMD_X86
+// SIMD versions of brain_play_step_scalar. These give the same results as the scalar code:
+// sums are accumulated in the same order (one sumsi per lane), the nonlinearity divides in float
+// (which rounds the same as dividing in double), and learning is calculated in double as in C.
 
-// Initialise the genes
-void genes_init(struct genes_t *genes) {
-    genes->learning_rate = INITIAL_LEARNING_RATE;
-    genes->thinking_time = INITIAL_THINKING_TIME;
+__attribute__((target("avx2")))
+void brain_play_step_avx2(struct brain_t *brain, TYPE_VALUE *input_state) {
+    int i, k, b, j, lane, n;
+    TYPE_VALUE *weight_state = brain->weight_state;
+    TYPE_VALUE *sumsi_state = brain->sumsi_state;
+    TYPE_VALUE *weights = brain->weights;
+    const TYPE_VALUE learning_rate = brain->learning_rate;
+    float tmp[8];
+    __m256i idx;
+    __m256 v, c;
+    __m256d d;
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 tenth = _mm256_set1_ps(10.);
+    const __m256 lr = _mm256_set1_ps(learning_rate);
+    const __m256d lr_inv = _mm256_set1_pd(1. - learning_rate);
     
-    genes->commands[0] = CMD_WEIGHT_TO_INPUT;
-    genes->args[0] = 8;
+    // Update weight states. AVX2 cannot scatter, so the gathered values are stored one by one
+    n = brain->in_global_num;
+    for(k=0; k+8<=n; k+=8) {
+        idx = _mm256_loadu_si256((const __m256i*)&brain->in_global_src[k]);
+        _mm256_storeu_ps(tmp, _mm256_i32gather_ps(input_state, idx, 4));
+        for(lane=0; lane<8; lane++) { weight_state[brain->in_global_weight[k+lane]] = tmp[lane]; }
+    }
+    for(; k<n; k++) { weight_state[brain->in_global_weight[k]] = input_state[brain->in_global_src[k]]; }
+    n = brain->in_sumsi_num;
+    for(k=0; k+8<=n; k+=8) {
+        idx = _mm256_loadu_si256((const __m256i*)&brain->in_sumsi_src[k]);
+        _mm256_storeu_ps(tmp, _mm256_i32gather_ps(sumsi_state, idx, 4));
+        for(lane=0; lane<8; lane++) { weight_state[brain->in_sumsi_weight[k+lane]] = tmp[lane]; }
+    }
+    for(; k<n; k++) { weight_state[brain->in_sumsi_weight[k]] = sumsi_state[brain->in_sumsi_src[k]]; }
     
-    genes->commands[1] = CMD_WEIGHT_TO_SUMSI_IN;
-    genes->args[1] = 0;
+    // Apply the weights
+    n = brain->weight_num;
+    for(i=1; i+8<=n; i+=8) {
+        _mm256_storeu_ps(&weight_state[i], _mm256_mul_ps(_mm256_loadu_ps(&weight_state[i]), _mm256_loadu_ps(&weights[i])));
+    }
+    for(; i<n; i++) { weight_state[i] *= weights[i]; }
     
-    genes->commands[2] = CMD_SUMSI_TO_OUT;
-    genes->args[2] = ARG_DUMMY;
+    // Sums and nonlinearity, 8 sumsis at a time
+    for(b=0; b<brain->out_slice_num; b++) {
+        for(lane=0; lane<SIMD_SLICE; lane+=8) {
+            const int *w = &brain->out_slice_weight[brain->out_slice_start[b] + lane];
+            v = zero;
+            for(j=0; j<brain->out_slice_len[b]; j++) {
+                idx = _mm256_loadu_si256((const __m256i*)&w[j * SIMD_SLICE]);
+                v = _mm256_add_ps(v, _mm256_i32gather_ps(weight_state, idx, 4));
+            }
+            v = _mm256_blendv_ps(v, _mm256_div_ps(v, tenth), _mm256_cmp_ps(v, zero, _CMP_LT_OQ));
+            _mm256_storeu_ps(tmp, v);
+            for(k=0; k<8; k++) { sumsi_state[brain->out_slice_target[b * SIMD_SLICE + lane + k]] = tmp[k]; }
+        }
+    }
     
-    genes->length = 3;    
+    // Learning: apply the control. Each weight has one control so there are no conflicts
+    for(int src_sumsi=0; src_sumsi<2; src_sumsi++) {
+        const TYPE_VALUE *src = (src_sumsi ? sumsi_state : weight_state);
+        const int *ctrl_weight = (src_sumsi ? brain->ctrl_sumsi_weight : brain->ctrl_weight_weight);
+        const int *ctrl_src = (src_sumsi ? brain->ctrl_sumsi_src : brain->ctrl_weight_src);
+        n = (src_sumsi ? brain->ctrl_sumsi_num : brain->ctrl_weight_num);
+        for(k=0; k+8<=n; k+=8) {
+            c = _mm256_mul_ps(_mm256_i32gather_ps(src, _mm256_loadu_si256((const __m256i*)&ctrl_src[k]), 4), lr);
+            v = _mm256_i32gather_ps(weights, _mm256_loadu_si256((const __m256i*)&ctrl_weight[k]), 4);
+            d = _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(c)), _mm256_mul_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)), lr_inv));
+            _mm_storeu_ps(tmp, _mm256_cvtpd_ps(d));
+            d = _mm256_add_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(c, 1)), _mm256_mul_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)), lr_inv));
+            _mm_storeu_ps(tmp + 4, _mm256_cvtpd_ps(d));
+            for(lane=0; lane<8; lane++) { weights[ctrl_weight[k+lane]] = tmp[lane]; }
+        }
+        for(; k<n; k++) {
+            i = ctrl_weight[k];
+            weights[i] = src[ctrl_src[k]] * learning_rate + weights[i] * (1. - learning_rate);
+        }
+    }
 }
 
 
-// Print info
-void genes_print_info(const struct genes_t *genes) {
+// Convert the lower or upper 8 floats of a vector to double
+#define SIMD_512_LO_PD(v) _mm512_cvtps_pd(_mm512_castps512_ps256(v))
+#define SIMD_512_HI_PD(v) _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1)))
+
+__attribute__((target("avx512f")))
+void brain_play_step_avx512(struct brain_t *brain, TYPE_VALUE *input_state) {
+    int i, k, b, j, n;
+    TYPE_VALUE *weight_state = brain->weight_state;
+    TYPE_VALUE *sumsi_state = brain->sumsi_state;
+    TYPE_VALUE *weights = brain->weights;
+    const TYPE_VALUE learning_rate = brain->learning_rate;
+    __m512i idx;
+    __m512 v, c;
+    __m256 lo, hi;
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 tenth = _mm512_set1_ps(10.);
+    const __m512 lr = _mm512_set1_ps(learning_rate);
+    const __m512d lr_inv = _mm512_set1_pd(1. - learning_rate);
+    
+    // Update weight states
+    n = brain->in_global_num;
+    for(k=0; k+16<=n; k+=16) {
+        v = _mm512_i32gather_ps(_mm512_loadu_si512(&brain->in_global_src[k]), input_state, 4);
+        _mm512_i32scatter_ps(weight_state, _mm512_loadu_si512(&brain->in_global_weight[k]), v, 4);
+    }
+    for(; k<n; k++) { weight_state[brain->in_global_weight[k]] = input_state[brain->in_global_src[k]]; }
+    n = brain->in_sumsi_num;
+    for(k=0; k+16<=n; k+=16) {
+        v = _mm512_i32gather_ps(_mm512_loadu_si512(&brain->in_sumsi_src[k]), sumsi_state, 4);
+        _mm512_i32scatter_ps(weight_state, _mm512_loadu_si512(&brain->in_sumsi_weight[k]), v, 4);
+    }
+    for(; k<n; k++) { weight_state[brain->in_sumsi_weight[k]] = sumsi_state[brain->in_sumsi_src[k]]; }
+    
+    // Apply the weights
+    n = brain->weight_num;
+    for(i=1; i+16<=n; i+=16) {
+        _mm512_storeu_ps(&weight_state[i], _mm512_mul_ps(_mm512_loadu_ps(&weight_state[i]), _mm512_loadu_ps(&weights[i])));
+    }
+    for(; i<n; i++) { weight_state[i] *= weights[i]; }
+    
+    // Sums and nonlinearity, a whole slice at a time
+    // Spare lanes all write 0 into sumsi 0 so the duplicate indices do not matter
+    for(b=0; b<brain->out_slice_num; b++) {
+        const int *w = &brain->out_slice_weight[brain->out_slice_start[b]];
+        v = zero;
+        for(j=0; j<brain->out_slice_len[b]; j++) {
+            idx = _mm512_loadu_si512(&w[j * SIMD_SLICE]);
+            v = _mm512_add_ps(v, _mm512_i32gather_ps(idx, weight_state, 4));
+        }
+        v = _mm512_mask_div_ps(v, _mm512_cmp_ps_mask(v, zero, _CMP_LT_OQ), v, tenth);
+        _mm512_i32scatter_ps(sumsi_state, _mm512_loadu_si512(&brain->out_slice_target[b * SIMD_SLICE]), v, 4);
+    }
+    
+    // Learning: apply the control. Each weight has one control so there are no conflicts
+    for(int src_sumsi=0; src_sumsi<2; src_sumsi++) {
+        const TYPE_VALUE *src = (src_sumsi ? sumsi_state : weight_state);
+        const int *ctrl_weight = (src_sumsi ? brain->ctrl_sumsi_weight : brain->ctrl_weight_weight);
+        const int *ctrl_src = (src_sumsi ? brain->ctrl_sumsi_src : brain->ctrl_weight_src);
+        n = (src_sumsi ? brain->ctrl_sumsi_num : brain->ctrl_weight_num);
+        for(k=0; k+16<=n; k+=16) {
+            idx = _mm512_loadu_si512(&ctrl_weight[k]);
+            c = _mm512_mul_ps(_mm512_i32gather_ps(_mm512_loadu_si512(&ctrl_src[k]), src, 4), lr);
+            v = _mm512_i32gather_ps(idx, weights, 4);
+            lo = _mm512_cvtpd_ps(_mm512_add_pd(SIMD_512_LO_PD(c), _mm512_mul_pd(SIMD_512_LO_PD(v), lr_inv)));
+            hi = _mm512_cvtpd_ps(_mm512_add_pd(SIMD_512_HI_PD(c), _mm512_mul_pd(SIMD_512_HI_PD(v), lr_inv)));
+            v = _mm512_castpd_ps(_mm512_insertf64x4(_mm512_castps_pd(_mm512_castps256_ps512(lo)), _mm256_castps_pd(hi), 1));
+            _mm512_i32scatter_ps(weights, idx, v, 4);
+        }
+        for(; k<n; k++) {
+            i = ctrl_weight[k];
+            weights[i] = src[ctrl_src[k]] * learning_rate + weights[i] * (1. - learning_rate);
+        }
+    }
+}
+#endif
+
+
+// The brain step used, see brain_select_kernels
+void (*brain_play_step)(struct brain_t *brain, TYPE_VALUE *input_state) = brain_play_step_scalar;
+const char *brain_kernels = "scalar"; // the name of it
+
+
+// Choose the fastest brain step that the CPU supports
+void brain_select_kernels(void) {
+#if SIMD_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) {
+        brain_play_step = brain_play_step_avx512;
+        brain_kernels = "avx512";
+    }
+    else if(__builtin_cpu_supports("avx2")) {
+        brain_play_step = brain_play_step_avx2;
+        brain_kernels = "avx2";
+    }
+#endif
+    brain_use_slices = (brain_play_step != brain_play_step_scalar);
+    fprintf(stderr, "Brain kernels: %s\n", brain_kernels);
+}
+
+
+// Return the output from the brain
+TYPE_VALUE brain_get_output(const struct brain_t *brain) {
+    if(brain->output_conn == 0) { return 0; }
+    return brain->sumsi_state[brain->output_conn];
+}
+
+
+// ==== GENES ====================================================================================================================
+
+// Genes are stored in chunks of up to GENES_CHUNK commands from genes_arena
+// Chunks are shared by genes derived from each other (clones, offspring, crossovers) and are freed when no genes use them.
+// A chunk is not changed while it is shared (see genes_own_chunk), so new genes only copy the parts that differ
+#define GENES_CHUNK 64
+
+// Base of the polynomial hash of commands, so that the hash of genes can be put together from the hashes of chunks
+#define GENES_HASH_BASE 0x9E3779B97F4A7C15ULL
+
+struct genes_command_t {
+    int command;
+    int arg;
+};
+
+struct genes_chunk_t {
+    int refs; // number of genes using the chunk; changed atomically, as genes are bred by many threads
+    int length;
+    size_t mem_size;
+    uint64_t hash; // sum of hash(command j) * GENES_HASH_BASE^j
+    uint64_t shift; // GENES_HASH_BASE^length
+    struct genes_command_t commands[]; // [length]
+};
+
+struct genes_t {
+    TYPE_VALUE learning_rate;
+    TYPE_VALUE thinking_time;
+    struct genes_chunk_t **chunks; // [chunk_capacity]
+    int chunk_num;
+    int chunk_capacity;
+    size_t mem_size; // of chunks
+    int length;
+    int changed_from; // first command that may differ from the genes these were derived from (see genes_rebuild_brain)
+    uint64_t hash; // hash of the commands, put together from the chunks (see genes_hash)
+};
+
+
+struct genes_t *genes_alloc(int count) {
+    struct genes_t *genes = malloc(count * sizeof(struct genes_t));
+    if(genes == NULL) { die("Out of memory"); }
+    for(int i=0; i<count; i++) {
+        genes[i].chunks = NULL;
+        genes[i].chunk_num = 0;
+        genes[i].chunk_capacity = 0;
+        genes[i].mem_size = 0;
+        genes[i].length = 0;
+        genes[i].changed_from = 0;
+        genes[i].hash = 0;
+    }
+    return genes;
+}
+
+
+// Hash of one command
+static inline uint64_t genes_hash_command(const struct genes_command_t *c) {
+    return rng_mix(rng_mix((uint32_t)c->command) ^ (uint32_t)c->arg);
+}
+
+
+// Create a chunk from length commands
+struct genes_chunk_t *genes_chunk_new(const struct genes_command_t *commands, int length) {
+    size_t mem_size;
+    struct genes_chunk_t *chunk = arena_alloc(&genes_arena, sizeof(struct genes_chunk_t) + length * sizeof(struct genes_command_t), &mem_size);
+    uint64_t shift = 1;
+    
+    chunk->refs = 1;
+    chunk->length = length;
+    chunk->mem_size = mem_size;
+    chunk->hash = 0;
+    memcpy(chunk->commands, commands, length * sizeof(struct genes_command_t));
+    for(int j=0; j<length; j++) {
+        chunk->hash += genes_hash_command(&commands[j]) * shift;
+        shift *= GENES_HASH_BASE;
+    }
+    chunk->shift = shift;
+    return chunk;
+}
+
+
+static inline void genes_chunk_share(struct genes_chunk_t *chunk) {
+    __atomic_fetch_add(&chunk->refs, 1, __ATOMIC_RELAXED);
+}
+
+
+void genes_chunk_release(struct genes_chunk_t *chunk) {
+    if(__atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        arena_free(&genes_arena, chunk, chunk->mem_size);
+    }
+}
+
+
+// Put together the hash of the genes from the hashes of the chunks
+void genes_hash_chunks(struct genes_t *genes) {
+    uint64_t h = 0, shift = 1;
+    for(int c=0; c<genes->chunk_num; c++) {
+        h += genes->chunks[c]->hash * shift;
+        shift *= genes->chunks[c]->shift;
+    }
+    genes->hash = h;
+}
+
+
+// Hash of the whole genes
+uint64_t genes_hash(const struct genes_t *genes) {
+    uint64_t learning_rate = 0, thinking_time = 0;
+    memcpy(&learning_rate, &genes->learning_rate, sizeof(TYPE_VALUE));
+    memcpy(&thinking_time, &genes->thinking_time, sizeof(TYPE_VALUE));
+    return rng_mix(rng_mix(genes->hash ^ learning_rate) + thinking_time * 0x9E3779B97F4A7C15ULL + (uint64_t)genes->length);
+}
+
+
+// Find the chunk holding command i. Sets offset to the position of the command in the chunk
+int genes_find_chunk(const struct genes_t *genes, int i, int *offset) {
+    int c;
+    for(c=0; c<genes->chunk_num && i >= genes->chunks[c]->length; c++) { i -= genes->chunks[c]->length; }
+    *offset = i;
+    return c;
+}
+
+
+// Make sure chunk c is only used by these genes, so that it can be changed
+struct genes_chunk_t *genes_own_chunk(struct genes_t *genes, int c) {
+    struct genes_chunk_t *chunk = genes->chunks[c];
+    if(__atomic_load_n(&chunk->refs, __ATOMIC_ACQUIRE) > 1) {
+        genes->chunks[c] = genes_chunk_new(chunk->commands, chunk->length);
+        genes_chunk_release(chunk);
+    }
+    return genes->chunks[c];
+}
+
+
+// Recalculate the hash of a chunk after its commands have been changed (see genes_own_chunk)
+void genes_chunk_rehash(struct genes_chunk_t *chunk) {
+    uint64_t shift = 1;
+    chunk->hash = 0;
+    for(int j=0; j<chunk->length; j++) {
+        chunk->hash += genes_hash_command(&chunk->commands[j]) * shift;
+        shift *= GENES_HASH_BASE;
+    }
+}
+
+
+// Whether two genes are the same
+int genes_equal(const struct genes_t *genes1, const struct genes_t *genes2) {
+    int c1 = 0, c2 = 0, j1 = 0, j2 = 0, n;
+    const struct genes_chunk_t *chunk1, *chunk2;
+    
+    if(genes1->length != genes2->length
+        || genes1->learning_rate != genes2->learning_rate
+        || genes1->thinking_time != genes2->thinking_time
+    ) { return 0; }
+    while(c1 < genes1->chunk_num && c2 < genes2->chunk_num) {
+        chunk1 = genes1->chunks[c1];
+        chunk2 = genes2->chunks[c2];
+        n = chunk1->length - j1;
+        if(n > chunk2->length - j2) { n = chunk2->length - j2; }
+        if(!(chunk1 == chunk2 && j1 == j2) && memcmp(&chunk1->commands[j1], &chunk2->commands[j2], n * sizeof(struct genes_command_t)) != 0) { return 0; }
+        j1 += n;
+        j2 += n;
+        if(j1 == chunk1->length) { c1++; j1 = 0; }
+        if(j2 == chunk2->length) { c2++; j2 = 0; }
+    }
+    return 1;
+}
+
+
+// Find the genes that are the same as earlier genes in the pool
+// same_as[i] becomes the first genes identical to genes i (i itself if there is none)
+// Returns the number of genes that are duplicates
+int genes_find_duplicates(const struct genes_t *genepool, int count, int *same_as) {
+    int i, j, duplicate_num = 0;
+    int mask = 1;
+    uint64_t *hashes = malloc(count * sizeof(uint64_t));
+    while(mask < 2 * count) { mask *= 2; }
+    int *table = malloc(mask * sizeof(int)); // open addressing; holds the first of each kind
+    if(hashes == NULL || table == NULL) { die("Out of memory"); }
+    mask--;
+    for(j=0; j<=mask; j++) { table[j] = -1; }
+    
+    for(i=0; i<count; i++) {
+        hashes[i] = genes_hash(&genepool[i]);
+        same_as[i] = i;
+        for(j=hashes[i] & mask; table[j] != -1; j=(j+1) & mask) {
+            if(hashes[table[j]] == hashes[i] && genes_equal(&genepool[table[j]], &genepool[i])) {
+                same_as[i] = table[j];
+                duplicate_num++;
+                break;
+            }
+        }
+        if(same_as[i] == i) { table[j] = i; }
+    }
+    free(table);
+    free(hashes);
+    return duplicate_num;
+}
+
+
+// New genes are put together from new commands and ranges of existing genes by a builder.
+// Whole chunks of existing genes are shared; the rest is collected into new chunks
+struct genes_builder_t {
+    struct genes_chunk_t **chunks;
+    int chunk_num;
+    int chunk_capacity;
+    size_t mem_size;
+    int length;
+    int pending_num;
+    struct genes_command_t pending[GENES_CHUNK]; // commands for the next new chunk
+};
+
+
+void genes_builder_begin(struct genes_builder_t *builder, int length) {
+    builder->chunk_capacity = 2 * (length / GENES_CHUNK) + 8;
+    builder->chunks = arena_alloc(&genes_arena, builder->chunk_capacity * sizeof(struct genes_chunk_t *), &builder->mem_size);
+    builder->chunk_capacity = builder->mem_size / sizeof(struct genes_chunk_t *);
+    builder->chunk_num = 0;
+    builder->length = 0;
+    builder->pending_num = 0;
+}
+
+
+// Add a chunk (already counted for the builder)
+void genes_builder_push(struct genes_builder_t *builder, struct genes_chunk_t *chunk) {
+    struct genes_chunk_t **chunks;
+    size_t mem_size;
+    if(builder->chunk_num == builder->chunk_capacity) {
+        chunks = arena_alloc(&genes_arena, 2 * builder->chunk_capacity * sizeof(struct genes_chunk_t *), &mem_size);
+        memcpy(chunks, builder->chunks, builder->chunk_num * sizeof(struct genes_chunk_t *));
+        arena_free(&genes_arena, builder->chunks, builder->mem_size);
+        builder->chunks = chunks;
+        builder->mem_size = mem_size;
+        builder->chunk_capacity = mem_size / sizeof(struct genes_chunk_t *);
+    }
+    builder->chunks[builder->chunk_num++] = chunk;
+}
+
+
+void genes_builder_flush(struct genes_builder_t *builder) {
+    if(builder->pending_num == 0) { return; }
+    genes_builder_push(builder, genes_chunk_new(builder->pending, builder->pending_num));
+    builder->pending_num = 0;
+}
+
+
+// Add a new command
+void genes_builder_add(struct genes_builder_t *builder, int command, int arg) {
+    if(builder->pending_num == GENES_CHUNK) { genes_builder_flush(builder); }
+    builder->pending[builder->pending_num].command = command;
+    builder->pending[builder->pending_num].arg = arg;
+    builder->pending_num++;
+    builder->length++;
+}
+
+
+// Add length new commands
+void genes_builder_add_commands(struct genes_builder_t *builder, const struct genes_command_t *commands, int length) {
+    int n;
+    while(length > 0) {
+        if(builder->pending_num == GENES_CHUNK) { genes_builder_flush(builder); }
+        n = GENES_CHUNK - builder->pending_num;
+        if(n > length) { n = length; }
+        memcpy(&builder->pending[builder->pending_num], commands, n * sizeof(struct genes_command_t));
+        builder->pending_num += n;
+        builder->length += n;
+        commands += n;
+        length -= n;
+    }
+}
+
+
+// Add commands from..from+length-1 of the source
+void genes_builder_add_range(struct genes_builder_t *builder, const struct genes_t *source, int from, int length) {
+    int c, j, n;
+    struct genes_chunk_t *chunk;
+    
+    if(from < 0 || length < 0 || from + length > source->length) { die("genes_builder_add_range wrong range"); }
+    c = genes_find_chunk(source, from, &j);
+    while(length > 0) {
+        chunk = source->chunks[c];
+        n = chunk->length - j;
+        if(n > length) { n = length; }
+        if(n == chunk->length && builder->pending_num + n > GENES_CHUNK) {
+            // Share the whole chunk. It is copied instead if it fits with the new commands so that chunks do not get too small
+            genes_builder_flush(builder);
+            genes_chunk_share(chunk);
+            genes_builder_push(builder, chunk);
+        }
+        else if(n == chunk->length && builder->pending_num == 0) {
+            genes_chunk_share(chunk);
+            genes_builder_push(builder, chunk);
+        }
+        else {
+            if(builder->pending_num + n > GENES_CHUNK) { genes_builder_flush(builder); }
+            memcpy(&builder->pending[builder->pending_num], &chunk->commands[j], n * sizeof(struct genes_command_t));
+            builder->pending_num += n;
+        }
+        builder->length += n;
+        length -= n;
+        c++;
+        j = 0;
+    }
+}
+
+
+// Give the commands collected to the genes, and let go of their old commands
+// Chunks are packed again if there are too many small ones after many edits
+void genes_builder_end(struct genes_builder_t *builder, struct genes_t *genes) {
+    int c, j;
+    struct genes_builder_t packed;
+    
+    genes_builder_flush(builder);
+    if(builder->chunk_num > 2 * (builder->length / GENES_CHUNK) + 4) {
+        genes_builder_begin(&packed, builder->length);
+        for(c=0; c<builder->chunk_num; c++) {
+            for(j=0; j<builder->chunks[c]->length; j++) {
+                genes_builder_add(&packed, builder->chunks[c]->commands[j].command, builder->chunks[c]->commands[j].arg);
+            }
+            genes_chunk_release(builder->chunks[c]);
+        }
+        genes_builder_flush(&packed);
+        arena_free(&genes_arena, builder->chunks, builder->mem_size);
+        *builder = packed;
+    }
+    
+    for(c=0; c<genes->chunk_num; c++) { genes_chunk_release(genes->chunks[c]); }
+    arena_free(&genes_arena, genes->chunks, genes->mem_size);
+    genes->chunks = builder->chunks;
+    genes->chunk_num = builder->chunk_num;
+    genes->chunk_capacity = builder->chunk_capacity;
+    genes->mem_size = builder->mem_size;
+    genes->length = builder->length;
+    genes_hash_chunks(genes);
+}
+
+
+// Initialise the genes
+void genes_init(struct genes_t *genes) {
+    struct genes_builder_t builder;
+    genes->learning_rate = INITIAL_LEARNING_RATE;
+    genes->thinking_time = INITIAL_THINKING_TIME;
+    genes_builder_begin(&builder, 3);
+    genes_builder_add(&builder, CMD_WEIGHT_TO_INPUT, 8);
+    genes_builder_add(&builder, CMD_WEIGHT_TO_SUMSI_IN, 0);
+    genes_builder_add(&builder, CMD_SUMSI_TO_OUT, ARG_DUMMY);
+    genes_builder_end(&builder, genes);
+    genes->changed_from = 0;
+}
+
+
+// Print info
+void genes_print_info(const struct genes_t *genes) {
     fprintf(stderr, "Genes: learning rate: %f thinking time: %f length: %d\n", genes->learning_rate, genes->thinking_time, genes->length);
 }
 
 
-// Copy genes
+// Copy genes (sharing all the chunks)
 void genes_clone(const struct genes_t *source, struct genes_t *clone) {
+    struct genes_builder_t builder;
     clone->learning_rate = source->learning_rate;
     clone->thinking_time = source->thinking_time;
-    for(int i=0; i<source->length; i++) {
-        clone->commands[i] = source->commands[i];
-        clone->args[i] = source->args[i];
-    }
+    genes_builder_begin(&builder, source->length);
+    genes_builder_add_range(&builder, source, 0, source->length);
+    genes_builder_end(&builder, clone);
+    clone->changed_from = source->length;
+}
+
+
+// Let go of the commands of the genes
+void genes_clear(struct genes_t *genes) {
+    for(int c=0; c<genes->chunk_num; c++) { genes_chunk_release(genes->chunks[c]); }
+    arena_free(&genes_arena, genes->chunks, genes->mem_size);
+    genes->chunks = NULL;
+    genes->chunk_num = 0;
+    genes->chunk_capacity = 0;
+    genes->mem_size = 0;
+    genes->length = 0;
+    genes->hash = 0;
 }
 
 
@@ -462,13 +1765,15 @@ void genes_write(const struct genes_t *genes, FILE *fp, int human_readable) {
         genes->thinking_time, 
         genes->length
     );
-    for(int i=0; i<genes->length; i++) {
-        fprintf(
-            fp, 
-            (human_readable ? "[%d,%d] " : "%d\n%d\n"), 
-            genes->commands[i], 
-            genes->args[i]
-        );
+    for(int c=0; c<genes->chunk_num; c++) {
+        for(int j=0; j<genes->chunks[c]->length; j++) {
+            fprintf(
+                fp, 
+                (human_readable ? "[%d,%d] " : "%d\n%d\n"), 
+                genes->chunks[c]->commands[j].command, 
+                genes->chunks[c]->commands[j].arg
+            );
+        }
     }
     if(human_readable) { fprintf(fp, "\n"); }
 }
@@ -480,7 +1785,9 @@ void genes_read(struct genes_t *genes, FILE *fp) {
     char *membuf = NULL;
     int ret;
     int lineno = 0;
-    int commandno;
+    int length = 0;
+    int command = 0, arg;
+    struct genes_builder_t builder;
     
     while(1) {
         ret = getline(&membuf, &memlen, fp);
@@ -493,17 +1800,22 @@ void genes_read(struct genes_t *genes, FILE *fp) {
         if(lineno == 0 && strcmp(membuf, "brain_v1\n") != 0) { printf("[%s]\n", membuf); die("Brain gene signature error"); }
         if(lineno == 1 && sscanf(membuf, TYPE_VALUE_FORMAT, &genes->learning_rate) != 1) { die("Brain gene error 2"); }
         if(lineno == 2 && sscanf(membuf, TYPE_VALUE_FORMAT, &genes->thinking_time) != 1) { die("Brain gene error 3"); }
-        if(lineno == 3 && sscanf(membuf, "%d", &genes->length) != 1) { die("Brain gene error 4"); }
+        if(lineno == 3) {
+            if(sscanf(membuf, "%d", &length) != 1 || length < 1) { die("Brain gene error 4"); }
+            genes_builder_begin(&builder, length);
+        }
         if(lineno > 3) {
-            commandno = (lineno - 4) / 2;
             if((lineno % 2) == 0) {
-                if(sscanf(membuf, "%d", &genes->commands[commandno]) != 1) { die("Brain gene error 5"); }
-                // printf("Loaded command L%d %d: %d\n", lineno, commandno, genes->commands[commandno]);
+                if(sscanf(membuf, "%d", &command) != 1) { die("Brain gene error 5"); }
             }
             else {
-                if(sscanf(membuf, "%d", &genes->args[commandno]) != 1) { die("Brain gene error 6"); }
-                // printf("Loaded command arg L%d %d: %d\n", lineno, commandno, genes->args[commandno]);
-                if(commandno == genes->length - 1) { break; }
+                if(sscanf(membuf, "%d", &arg) != 1) { die("Brain gene error 6"); }
+                genes_builder_add(&builder, command, arg);
+                if(builder.length == length) {
+                    genes_builder_end(&builder, genes);
+                    genes->changed_from = 0;
+                    break;
+                }
             }
         }
         lineno++;
@@ -514,68 +1826,219 @@ void genes_read(struct genes_t *genes, FILE *fp) {
 
 // Create a brain based on the genes at the given location
 // Tie down random offsets in the genes as we do so
-void genes_create_brain(struct genes_t *genes, struct brain_t *brain) {
-    int i;
-    brain_constr_init(brain);
-    brain->learning_rate = genes->learning_rate;
-    brain->thinking_time = genes->thinking_time;
-    for(i=0; i<genes->length; i++) {
-        if(genes->args[i] == ARG_RAND_WEIGHT) {
-            genes->args[i] = (int)(getrand() * (brain->weight_stack_ix - 1));
-        }
-        else if(genes->args[i] == ARG_RAND_SUMSI) {
-            genes->args[i] = (int)(getrand() * (brain->sumsi_stack_ix - 1));
+// If base is given, construction continues from its snapshot k (the genes must be the same up to there)
+// Returns the number of commands processed
+int genes_build_brain(struct genes_t *genes, struct brain_t *brain, const struct brain_record_t *base, int k, struct rng_t *rng) {
+    int i, start = 0, c, j, rehash = 0;
+    struct genes_chunk_t *chunk;
+    struct brain_constr_t *constr = brain_constr_scratch();
+    struct brain_record_t *record = &brain->record;
+    
+    if(base == NULL) {
+        brain_constr_init(constr);
+        record->log_num = 0;
+        record->snapshot_num = 0;
+        constr->record = record;
+    }
+    else {
+        brain_constr_resume(constr, base, k, record);
+        start = k * BRAIN_SNAPSHOT_INTERVAL;
+    }
+    constr->learning_rate = genes->learning_rate;
+    constr->thinking_time = genes->thinking_time;
+    c = genes_find_chunk(genes, start, &j);
+    for(i=start; i<genes->length; i++, j++) {
+        if(j == genes->chunks[c]->length) { c++; j = 0; }
+        chunk = genes->chunks[c];
+        if(i % BRAIN_SNAPSHOT_INTERVAL == 0) { brain_record_snapshot(constr, record); }
+        if(chunk->commands[j].arg == ARG_RAND_WEIGHT || chunk->commands[j].arg == ARG_RAND_SUMSI) {
+            chunk = genes_own_chunk(genes, c);
+            chunk->commands[j].arg = (int)(getrand(rng) * (
+                (chunk->commands[j].arg == ARG_RAND_WEIGHT ? constr->weight_stack_ix : constr->sumsi_stack_ix) - 1
+            ));
+            genes_chunk_rehash(chunk);
+            rehash = 1;
         }
-        if(!brain_constr_process_command(brain, genes->commands[i], genes->args[i])) {
+        if(!brain_constr_process_command(constr, chunk->commands[j].command, chunk->commands[j].arg)) {
             genes_print_info(genes);
             die("Error while creating brain");
         }
     }
+    if(rehash) { genes_hash_chunks(genes); }
+    brain_record_save(constr, record);
+    constr->record = NULL;
+    brain_compile(constr, brain);
+    genes->changed_from = genes->length;
+    return genes->length - start;
 }
 
 
-// Inject a command at location
-void genes_inject(struct genes_t *genes, const int location, const int command, const int arg) {
-    if(location < 0 || location > genes->length) { 
-        fprintf(stderr, "location: %d length: %d\n", location, genes->length);
-        die("genes_inject wrong location 1"); 
+// Create a brain from all the genes
+void genes_create_brain(struct genes_t *genes, struct brain_t *brain, struct rng_t *rng) {
+    genes_build_brain(genes, brain, NULL, 0, rng);
+}
+
+
+// Create a brain for genes derived from the genes of the base brain (by genes_edit_apply onto another genes,
+// or genes_crossover), continuing from the last snapshot of the base before the first changed command
+// Returns the number of commands processed
+int genes_rebuild_brain(struct genes_t *genes, struct brain_t *brain, const struct brain_t *base, struct rng_t *rng) {
+    int k = genes->changed_from / BRAIN_SNAPSHOT_INTERVAL;
+    if(k >= base->record.snapshot_num) { k = base->record.snapshot_num - 1; }
+    if(k <= 0) { return genes_build_brain(genes, brain, NULL, 0, rng); }
+    return genes_build_brain(genes, brain, &base->record, k, rng);
+}
+
+
+// Edits of genes are planned first and then applied in one pass (see genes_edit_apply)
+// The edited genes are a list of pieces: a range of commands from the source, or a new command
+#define GENES_EDIT_PIECES 64
+
+struct genes_piece_t {
+    int from; // first command in the source, or -1 for a new command
+    int length;
+    int command; // the new command
+    int arg;
+};
+
+struct genes_edit_t {
+    const struct genes_t *source;
+    struct genes_t *target; // may be the source
+    TYPE_VALUE learning_rate;
+    TYPE_VALUE thinking_time;
+    int length; // of the edited genes
+    int piece_num;
+    struct genes_piece_t pieces[GENES_EDIT_PIECES];
+};
+
+
+// Start editing the source into the target
+void genes_edit_begin(struct genes_edit_t *edit, const struct genes_t *source, struct genes_t *target) {
+    edit->source = source;
+    edit->target = target;
+    edit->learning_rate = source->learning_rate;
+    edit->thinking_time = source->thinking_time;
+    edit->length = source->length;
+    edit->piece_num = 0;
+    if(source->length > 0) {
+        edit->pieces[0].from = 0;
+        edit->pieces[0].length = source->length;
+        edit->piece_num = 1;
+    }
+}
+
+
+// Apply the edits: the target gets the edited genes
+// Chunks of the source that are not edited are shared with the target. changed_from of the target
+// is set to the first edit so that brains can be rebuilt from there (see genes_rebuild_brain)
+void genes_edit_apply(struct genes_edit_t *edit) {
+    struct genes_t *target = edit->target;
+    struct genes_builder_t builder;
+    int k, first = 0, unchanged = 0;
+    
+    // The beginning that stays the same
+    while(first < edit->piece_num && edit->pieces[first].from == unchanged) {
+        unchanged += edit->pieces[first].length;
+        first++;
     }
-    if(genes->length >= MAX_GENES - 1) { die("Genes too long"); }
-    if(location < genes->length) {
-        for(int i=genes->length; i>location; i--) {
-            genes->commands[i] = genes->commands[i-1];
-            genes->args[i] = genes->args[i-1];
+    
+    if(target != edit->source || unchanged < edit->source->length || first < edit->piece_num) {
+        genes_builder_begin(&builder, edit->length);
+        for(k=0; k<edit->piece_num; k++) {
+            if(edit->pieces[k].from < 0) {
+                genes_builder_add(&builder, edit->pieces[k].command, edit->pieces[k].arg);
+            }
+            else {
+                genes_builder_add_range(&builder, edit->source, edit->pieces[k].from, edit->pieces[k].length);
+            }
         }
+        if(builder.length != edit->length) { die("genes_edit_apply wrong length"); }
+        genes_builder_end(&builder, target);
+    }
+    
+    if(target != edit->source) { target->changed_from = unchanged; }
+    else if(unchanged < target->changed_from) { target->changed_from = unchanged; }
+    target->learning_rate = edit->learning_rate;
+    target->thinking_time = edit->thinking_time;
+}
+
+
+// Apply the edits so far, and continue editing the result
+void genes_edit_flush(struct genes_edit_t *edit) {
+    genes_edit_apply(edit);
+    genes_edit_begin(edit, edit->target, edit->target);
+}
+
+
+// Find the piece holding command location of the edited genes, and make it start there
+// Returns piece_num at the end of the genes
+int genes_edit_find(struct genes_edit_t *edit, int location) {
+    int k;
+    for(k=0; k<edit->piece_num; k++) {
+        if(location < edit->pieces[k].length) { break; }
+        location -= edit->pieces[k].length;
+    }
+    if(location > 0) { // split a range of the source
+        memmove(&edit->pieces[k+1], &edit->pieces[k], (edit->piece_num - k) * sizeof(struct genes_piece_t));
+        edit->piece_num++;
+        edit->pieces[k].length = location;
+        k++;
+        edit->pieces[k].from += location;
+        edit->pieces[k].length -= location;
+    }
+    return k;
+}
+
+
+// Inject a command at location
+void genes_edit_inject(struct genes_edit_t *edit, const int location, const int command, const int arg) {
+    int k;
+    if(location < 0 || location > edit->length) { 
+        fprintf(stderr, "location: %d length: %d\n", location, edit->length);
+        die("genes_edit_inject wrong location 1"); 
     }
-    genes->commands[location] = command;
-    genes->args[location] = arg;
-    genes->length++;
+    if(edit->piece_num + 2 > GENES_EDIT_PIECES) { genes_edit_flush(edit); }
+    k = genes_edit_find(edit, location);
+    memmove(&edit->pieces[k+1], &edit->pieces[k], (edit->piece_num - k) * sizeof(struct genes_piece_t));
+    edit->piece_num++;
+    edit->pieces[k].from = -1;
+    edit->pieces[k].length = 1;
+    edit->pieces[k].command = command;
+    edit->pieces[k].arg = arg;
+    edit->length++;
 }
 
 
 // Remove a command at location
-void genes_remove(struct genes_t *genes, const int location) {
-    if(location < 0 || location >= genes->length) { 
-        fprintf(stderr, "location: %d length: %d\n", location, genes->length);
-        die("genes_remove wrong location 2"); 
+void genes_edit_remove(struct genes_edit_t *edit, const int location) {
+    int k;
+    if(location < 0 || location >= edit->length) { 
+        fprintf(stderr, "location: %d length: %d\n", location, edit->length);
+        die("genes_edit_remove wrong location 2"); 
+    }
+    if(edit->length <= 1) { return; }
+    if(edit->piece_num + 1 > GENES_EDIT_PIECES) { genes_edit_flush(edit); }
+    k = genes_edit_find(edit, location);
+    if(edit->pieces[k].length == 1) {
+        memmove(&edit->pieces[k], &edit->pieces[k+1], (edit->piece_num - k - 1) * sizeof(struct genes_piece_t));
+        edit->piece_num--;
     }
-    if(genes->length <= 1) { return; }
-    genes->length--;
-    for(int i=location; i<genes->length; i++) {
-        genes->commands[i] = genes->commands[i+1];
-        genes->args[i] = genes->args[i+1];
+    else {
+        edit->pieces[k].from++;
+        edit->pieces[k].length--;
     }
+    edit->length--;
 }
 
 
-// Mutate a gene sequence
-void genes_mutate(struct genes_t *genes) {
+// Plan a mutation of a gene sequence
+void genes_mutate_edit(struct genes_edit_t *edit, struct rng_t *rng) {
 #if MUTATE_THINKING_TIME
-    static int modes_length = 13;
-    static TYPE_VALUE modes[13] = {
+    static const int modes_length = 13;
+    static const TYPE_VALUE weights[13] = {
 #else
-    static int modes_length = 12;
-    static TYPE_VALUE modes[12] = {
+    static const int modes_length = 12;
+    static const TYPE_VALUE weights[12] = {
 #endif
         1, // 0: mutate learning rate
         1, // 1: inject CMD_SUMSI_TO_OUT
@@ -593,61 +2056,58 @@ void genes_mutate(struct genes_t *genes) {
         ,1  // 12: mutate thinking time
 #endif
     };
-    static int modes_init = 0;
+    TYPE_VALUE modes[13];
     
-    // Create probability boundaries
-    if(modes_init == 0) {
-        modes_init = 1;
-        int i;
-        TYPE_VALUE s = 0;
-        for(i=0; i<modes_length; i++) { 
-            s += modes[i];
-            modes[i] = s;
-        }
-        for(i=0; i<modes_length; i++) { modes[i] /= s; /* printf("MODE %d = %f\n",i,modes[i]); */ }
+    // Create probability boundaries (here, as threads mutate genes at the same time)
+    int i;
+    TYPE_VALUE s = 0;
+    for(i=0; i<modes_length; i++) { 
+        s += weights[i];
+        modes[i] = s;
     }
+    for(i=0; i<modes_length; i++) { modes[i] /= s; /* printf("MODE %d = %f\n",i,modes[i]); */ }
     
-    TYPE_VALUE mode_v = getrand();
+    TYPE_VALUE mode_v = getrand(rng);
     int mode = 0, loc;
     while(modes[mode] < mode_v && mode < modes_length) { mode++; }
     // printf("Mutate mode_v: %f mode: %d\n", mode_v, mode);
     switch(mode) {
         case 0: // mutate learning rate
-            genes->learning_rate *= getrand() * .4 + .8;
-            if(genes->learning_rate > 1) { genes->learning_rate = 1; }
+            edit->learning_rate *= getrand(rng) * .4 + .8;
+            if(edit->learning_rate > 1) { edit->learning_rate = 1; }
             break;
         case 1:
-            genes_inject(genes, getrand_location(genes->length), CMD_SUMSI_TO_OUT, ARG_DUMMY); break;
+            genes_edit_inject(edit, getrand_location(rng, edit->length), CMD_SUMSI_TO_OUT, ARG_DUMMY); break;
         case 2:
-            genes_inject(genes, getrand_location(genes->length), CMD_POP_WEIGHT, ARG_DUMMY); break;
+            genes_edit_inject(edit, getrand_location(rng, edit->length), CMD_POP_WEIGHT, ARG_DUMMY); break;
         case 3:
-            genes_inject(genes, getrand_location(genes->length), CMD_POP_SUMSI, ARG_DUMMY); break;
+            genes_edit_inject(edit, getrand_location(rng, edit->length), CMD_POP_SUMSI, ARG_DUMMY); break;
         case 4:
-            genes_inject(genes, getrand_location(genes->length), CMD_WEIGHT_TO_INPUT, ((int)(getrand() * NUM_INPUTS))); break;
+            genes_edit_inject(edit, getrand_location(rng, edit->length), CMD_WEIGHT_TO_INPUT, ((int)(getrand(rng) * NUM_INPUTS))); break;
         case 5:
-            genes_remove(genes, ((int)(getrand() * genes->length))); break;
+            genes_edit_remove(edit, ((int)(getrand(rng) * edit->length))); break;
         case 6:
-            genes_inject(genes, getrand_location(genes->length), CMD_SUMSI_TO_WEIGHT_IN, ARG_RAND_WEIGHT); break;
+            genes_edit_inject(edit, getrand_location(rng, edit->length), CMD_SUMSI_TO_WEIGHT_IN, ARG_RAND_WEIGHT); break;
         case 7:
-            genes_inject(genes, getrand_location(genes->length), CMD_SUMSI_TO_WEIGHT_CTRL, ARG_RAND_WEIGHT); break;
+            genes_edit_inject(edit, getrand_location(rng, edit->length), CMD_SUMSI_TO_WEIGHT_CTRL, ARG_RAND_WEIGHT); break;
         case 8:
-            genes_inject(genes, getrand_location(genes->length), CMD_WEIGHT_TO_WEIGHT_CTRL, ARG_RAND_WEIGHT); break;
+            genes_edit_inject(edit, getrand_location(rng, edit->length), CMD_WEIGHT_TO_WEIGHT_CTRL, ARG_RAND_WEIGHT); break;
         case 9:
-            genes_inject(genes, getrand_location(genes->length), CMD_WEIGHT_TO_SUMSI_IN, ARG_RAND_SUMSI); break;
+            genes_edit_inject(edit, getrand_location(rng, edit->length), CMD_WEIGHT_TO_SUMSI_IN, ARG_RAND_SUMSI); break;
         case 10:
-            loc = getrand_location(genes->length);
-            genes_inject(genes, loc, CMD_NEW_SUMSI, ARG_DUMMY);
-            genes_inject(genes, loc+1, CMD_WEIGHT_TO_SUMSI_IN, 0);
+            loc = getrand_location(rng, edit->length);
+            genes_edit_inject(edit, loc, CMD_NEW_SUMSI, ARG_DUMMY);
+            genes_edit_inject(edit, loc+1, CMD_WEIGHT_TO_SUMSI_IN, 0);
             break;
         case 11:
-            loc = getrand_location(genes->length);
-            genes_inject(genes, loc, CMD_NEW_WEIGHT, (int)(getrand() * 200. - 100.));
-            genes_inject(genes, loc+1, CMD_SUMSI_TO_WEIGHT_IN, 0);
+            loc = getrand_location(rng, edit->length);
+            genes_edit_inject(edit, loc, CMD_NEW_WEIGHT, (int)(getrand(rng) * 200. - 100.));
+            genes_edit_inject(edit, loc+1, CMD_SUMSI_TO_WEIGHT_IN, 0);
             break;
 #if MUTATE_THINKING_TIME
         case 12:
-            genes->thinking_time *= getrand() * .4 + .8; 
-            if(genes->thinking_time < MIN_THINKING_TIME) { genes->thinking_time = MIN_THINKING_TIME; }
+            edit->thinking_time *= getrand(rng) * .4 + .8; 
+            if(edit->thinking_time < MIN_THINKING_TIME) { edit->thinking_time = MIN_THINKING_TIME; }
             break;
 #endif
         default:
@@ -656,13 +2116,23 @@ void genes_mutate(struct genes_t *genes) {
 }
 
 
+// Mutate a gene sequence
+void genes_mutate(struct genes_t *genes, struct rng_t *rng) {
+    struct genes_edit_t edit;
+    genes_edit_begin(&edit, genes, genes);
+    genes_mutate_edit(&edit, rng);
+    genes_edit_apply(&edit);
+}
+
+
 // Create crossover of two genes
-void genes_crossover(const struct genes_t *src1, const struct genes_t *src2, struct genes_t *dst1, struct genes_t *dst2) {
+void genes_crossover(const struct genes_t *src1, const struct genes_t *src2, struct genes_t *dst1, struct genes_t *dst2, struct rng_t *rng) {
     TYPE_VALUE start, end, snip;
-    int start1, start2, end1, end2, i, a, b;
+    int start1, start2, end1, end2;
+    struct genes_builder_t builder;
     
-    snip = getrand() * .8; // length of snippet (0..1)
-    start = getrand() * (1. - snip); // starting point (0..1)
+    snip = getrand(rng) * .8; // length of snippet (0..1)
+    start = getrand(rng) * (1. - snip); // starting point (0..1)
     end = start + snip;
 
     start1 = src1->length * start;    
@@ -680,68 +2150,29 @@ void genes_crossover(const struct genes_t *src1, const struct genes_t *src2, str
     
     dst1->learning_rate = src1->learning_rate * (1. - snip) + src2->learning_rate * snip;
     dst1->thinking_time = src1->thinking_time * (1. - snip) + src2->thinking_time * snip;
-    dst1->length = start1 + (end2 - start2) + (src1->length - end1);
-    if(dst1->length >= MAX_GENES) { die("Crossover too long 1"); }
-    for(i=0; i<start1; i++) {
-        a = i;
-        b = i;
-        if(a >= dst1->length) { die("Crossover E1"); }
-        if(b >= src1->length) { die("Crossover E2"); }
-        dst1->commands[a] = src1->commands[b]; 
-        dst1->args[a]     = src1->args[b]; 
-    }
-    for(i=0; i<(end2-start2); i++) { 
-        a = i + start1;
-        b = i + start2;
-        if(a >= dst1->length) { die("Crossover E3"); }
-        if(b >= src2->length) { die("Crossover E4"); }
-        dst1->commands[a] = src2->commands[b]; 
-        dst1->args[a]     = src2->args[b]; 
-    }
-    for(i=0; i<(src1->length-end1); i++) {
-        a = i+start1+end2-start2;
-        b = i+end1;
-        if(a >= dst1->length) { die("Crossover E5"); }
-        if(a < 0) { die("Crossover E6"); }
-        if(b >= src1->length) { die("Crossover E7"); }
-        dst1->commands[a] = src1->commands[b];
-        dst1->args[a]     = src1->args[b];
-    }
+    genes_builder_begin(&builder, start1 + (end2 - start2) + (src1->length - end1));
+    genes_builder_add_range(&builder, src1, 0, start1);
+    genes_builder_add_range(&builder, src2, start2, end2 - start2);
+    genes_builder_add_range(&builder, src1, end1, src1->length - end1);
+    genes_builder_end(&builder, dst1);
+    dst1->changed_from = start1;
     
     dst2->learning_rate = src2->learning_rate * (1. - snip) + src1->learning_rate * snip;
     dst2->thinking_time = src2->thinking_time * (1. - snip) + src1->thinking_time * snip;
-    dst2->length = start2 + (end1 - start1) + (src2->length - end2);
-    if(dst2->length >= MAX_GENES) { die("Crossover too long 2"); }
-    for(i=0; i<start2; i++) { 
-        a = i;
-        b = i;
-        if(a >= dst2->length) { die("Crossover E8"); }
-        if(b >= src2->length) { die("Crossover E9"); }
-        dst2->commands[a] = src2->commands[b]; 
-        dst2->args[a]     = src2->args[b]; 
-    }
-    for(i=0; i<(end1-start1); i++) { 
-        a = i + start2;
-        b = i + start1;
-        if(a >= dst2->length) { die("Crossover E10"); }
-        if(b >= src1->length) { die("Crossover E11"); }
-        dst2->commands[a] = src1->commands[b]; 
-        dst2->args[a]     = src1->args[b]; 
-    }
-    for(i=0; i<(src2->length-end2); i++) { 
-        a = i+start2+end1-start1;
-        b = i+end2;
-        if(a >= dst2->length) { die("Crossover E12"); }
-        if(a < 0) { die("Crossover E13"); }
-        if(b >= src2->length) { die("Crossover E14"); }
-        dst2->commands[a] = src2->commands[b];
-        dst2->args[a]     = src2->args[b];
-    }
+    genes_builder_begin(&builder, start2 + (end1 - start1) + (src2->length - end2));
+    genes_builder_add_range(&builder, src2, 0, start2);
+    genes_builder_add_range(&builder, src1, start1, end1 - start1);
+    genes_builder_add_range(&builder, src2, end2, src2->length - end2);
+    genes_builder_end(&builder, dst2);
+    dst2->changed_from = start2;
 }
 
 // ==== TASK ===================================================================================================================
 // Create a wavy surface
 
+// Number of random points drawn and calculated at a time when making questions
+#define TASK_BATCH 256
+
 struct task_t {
     TYPE_VALUE x_freq1; // sine function in x direction
     TYPE_VALUE x_phase1;
@@ -757,55 +2188,203 @@ struct task_t {
     
     TYPE_VALUE pol_freq; // sine function in radial direction
     TYPE_VALUE pol_phase;
-
+    
+    struct rng_t rng; // for the surface and the questions
+    
+#if TASK_SIGN_MAP
+    // Cells of the sign map, a bit per cell in rows of 64 bit words
+    // Known cells have the same sign everywhere; the sign is set if the values are positive
+    uint64_t *map_known;
+    uint64_t *map_sign;
+#endif
+    
+    // Points drawn from rng with their values, batch_ix..batch_num-1 are still to be used (see task_next_point)
+    int batch_ix;
+    int batch_num;
+    TYPE_VALUE batch_x[TASK_BATCH];
+    TYPE_VALUE batch_y[TASK_BATCH];
+    TYPE_VALUE batch_v[TASK_BATCH];
+    
+    // The questions, made by task_init and only read afterwards
+    // Question q shows a positive and a negative point, and asks about the question point
+    TYPE_VALUE pos_x[STEPS];
+    TYPE_VALUE pos_y[STEPS];
+    TYPE_VALUE neg_x[STEPS];
+    TYPE_VALUE neg_y[STEPS];
+    TYPE_VALUE question_x[STEPS];
+    TYPE_VALUE question_y[STEPS];
+    int target[STEPS];
+    int target_1_num; // stats
+    int baseline_correct; // number of questions the baseline strategy answers correctly (see CALCULATE_BASELINE)
+    
 #if CALCULATE_BASELINE
-    int step;
-    TYPE_VALUE examples_pos_x[STEPS];
-    TYPE_VALUE examples_pos_y[STEPS];
-    TYPE_VALUE examples_neg_x[STEPS];
-    TYPE_VALUE examples_neg_y[STEPS];
+    // Examples seen so far by cell (see task_baseline_add). Example 2*q is the positive and 2*q+1 is
+    // the negative point of question q
+    int baseline_head[BASELINE_GRID * BASELINE_GRID]; // first example in each cell, -1 if none
+    int baseline_next[2 * STEPS]; // next example in the same cell
 #endif
 };
 
-TYPE_VALUE task_init_freq(void) {
+TYPE_VALUE task_init_freq(struct rng_t *rng) {
     TYPE_VALUE min_freq = .2;
     TYPE_VALUE max_freq = 6.;
-    return min_freq + getrand() * (max_freq - min_freq);    
+    return min_freq + getrand(rng) * (max_freq - min_freq);    
 }
 
-TYPE_VALUE task_init_phase(void) {
-    return getrand() * 3.14159;
+TYPE_VALUE task_init_phase(struct rng_t *rng) {
+    return getrand(rng) * 3.14159;
 }
 
 struct task_t *task_alloc(void) {
-    struct task_t *task = malloc(sizeof(struct task_t));
+    // Zeroed, as task_init does not set all parameters, and all processes need the same surfaces (see DISTRIBUTE)
+    struct task_t *task = calloc(1, sizeof(struct task_t));
     if(task == NULL) { die("Out of memory"); }
+#if TASK_SIGN_MAP
+    size_t words = ((size_t)1 << (2 * TASK_SIGN_MAP_BITS)) / 64;
+    task->map_known = malloc(words * sizeof(uint64_t));
+    task->map_sign = malloc(words * sizeof(uint64_t));
+    if(task->map_known == NULL || task->map_sign == NULL) { die("Out of memory"); }
+#endif
     return task;
 }
 
+// Get the values on the surface at n points. Call with x, y in [-1, 1]
+// Each term is calculated for all points in turn, and added in the same order for every point
+void task_get_values(const struct task_t *task, int n, const TYPE_VALUE *x, const TYPE_VALUE *y, TYPE_VALUE *v) {
+    int k;
+    TYPE_VALUE pol;
+    for(k=0; k<n; k++) { v[k] = 0; }
+    for(k=0; k<n; k++) { v[k] += sin(task->x_freq1 * x[k] + task->x_phase1); }
+    for(k=0; k<n; k++) { v[k] += sin(task->y_freq1 * y[k] + task->y_phase1); }
+    for(k=0; k<n; k++) { v[k] += sin(task->x_freq2 * x[k] + task->x_phase2); }
+    for(k=0; k<n; k++) { v[k] += sin(task->y_freq2 * y[k] + task->y_phase2); }
+    for(k=0; k<n; k++) {
+        pol = sqrt(x[k]*x[k] + y[k]*y[k]);
+        v[k] += sin(task->pol_freq * pol + task->pol_phase);
+    }
+}
+
+
 // Get a value on the surface. Call with x, y in [-1, 1]
 TYPE_VALUE task_get_value(const struct task_t *task, TYPE_VALUE x, TYPE_VALUE y) {
-    TYPE_VALUE o = 0, pol;
-    o += sin(task->x_freq1 * x + task->x_phase1);
-    o += sin(task->y_freq1 * y + task->y_phase1);
-    o += sin(task->x_freq2 * x + task->x_phase2);
-    o += sin(task->y_freq2 * y + task->y_phase2);
-    pol = sqrt(x*x + y*y);
-    o += sin(task->pol_freq * pol + task->pol_phase);
+    TYPE_VALUE o;
+    task_get_values(task, 1, &x, &y, &o);
     return o;
 }
 
 
+#if TASK_SIGN_MAP
+// Values closer to zero than this are not trusted to the sign map (calculations in float are not exact)
+#define TASK_SIGN_MAP_MARGIN 1e-4
+
+// Mark the cells of a square block of the sign map
+void task_fill_sign_map(struct task_t *task, int row, int col, int size, int positive) {
+    int i, j;
+    const int words_per_row = (1 << TASK_SIGN_MAP_BITS) / 64;
+    uint64_t mask = (size >= 64 ? ~(uint64_t)0 : (((uint64_t)1 << size) - 1) << (col % 64));
+    for(i=row; i<row+size; i++) {
+        for(j=col/64; j<(col+size+63)/64; j++) {
+            task->map_known[i * words_per_row + j] |= mask;
+            if(positive) { task->map_sign[i * words_per_row + j] |= mask; }
+        }
+    }
+}
+
+
+// Make the sign map of a square block of cells
+// Each term of the value cannot change by more than its slope in the middle of the block times the
+// distance plus a second order term, so if the value in the middle is further from zero, the whole
+// block has the same sign. Otherwise the block is split into four.
+// Cells that are still not known are calculated when looked up (see task_get_sign).
+void task_make_sign_map_block(struct task_t *task, int row, int col, int size) {
+    const int n = 1 << TASK_SIGN_MAP_BITS;
+    double x = (col + size / 2.) * 2. / n - 1.;
+    double y = (row + size / 2.) * 2. / n - 1.;
+    double h = (double)size / n + 1e-6; // the largest distance in x or y from the middle
+    double r = sqrt(x*x + y*y);
+    double v = 0, bound = TASK_SIGN_MAP_MARGIN;
+    const double terms[5][3] = { // frequency, phase, coordinate
+        {task->x_freq1, task->x_phase1, x},
+        {task->y_freq1, task->y_phase1, y},
+        {task->x_freq2, task->x_phase2, x},
+        {task->y_freq2, task->y_phase2, y},
+        {task->pol_freq, task->pol_phase, r}
+    };
+    for(int k=0; k<5; k++) {
+        double d = (k < 4 ? h : h * 1.4143); // the radius changes by at most the distance
+        v += sin(terms[k][0] * terms[k][2] + terms[k][1]);
+        bound += fabs(terms[k][0] * cos(terms[k][0] * terms[k][2] + terms[k][1])) * d + terms[k][0] * terms[k][0] * d * d / 2.;
+    }
+    if(v > bound || v < -bound) {
+        task_fill_sign_map(task, row, col, size, v > 0);
+        return;
+    }
+    if(size == 1) { return; }
+    size /= 2;
+    task_make_sign_map_block(task, row, col, size);
+    task_make_sign_map_block(task, row, col + size, size);
+    task_make_sign_map_block(task, row + size, col, size);
+    task_make_sign_map_block(task, row + size, col + size, size);
+}
+
+
+// Make the sign map of the surface
+// Rows of the map go along y and columns along x
+void task_make_sign_map(struct task_t *task) {
+    size_t words = ((size_t)1 << (2 * TASK_SIGN_MAP_BITS)) / 64;
+    memset(task->map_known, 0, words * sizeof(uint64_t));
+    memset(task->map_sign, 0, words * sizeof(uint64_t));
+    task_make_sign_map_block(task, 0, 0, 1 << TASK_SIGN_MAP_BITS);
+}
+#endif
+
+
+// Get the sign of the value on the surface: -1, 0 or 1
+// Uses the sign map for the known cells
+int task_get_sign(const struct task_t *task, TYPE_VALUE x, TYPE_VALUE y) {
+    TYPE_VALUE v;
+#if TASK_SIGN_MAP
+    const int n = 1 << TASK_SIGN_MAP_BITS;
+    int row = (y + 1.) * (n / 2);
+    int col = (x + 1.) * (n / 2);
+    if(row >= 0 && row < n && col >= 0 && col < n) {
+        size_t word = (size_t)row * (n / 64) + col / 64;
+        uint64_t bit = (uint64_t)1 << (col % 64);
+        if(task->map_known[word] & bit) { return (task->map_sign[word] & bit ? 1 : -1); }
+    }
+#endif
+    v = task_get_value(task, x, y);
+    return (v > 0) - (v < 0);
+}
+
+
 // Ensure the positive and negative areas are roughly equal so the test set (the questions) would be evenly distributed
+// The x and y terms only depend on the column or the row of the grid, so they are calculated once per column and row
 int task_evaluate(const struct task_t *task) {
     int i, j, num_pos=0, num_neg=0;
-    TYPE_VALUE x, y, v;
+    const int n = TASK_EVAL_ZOOM * 2.;
+    TYPE_VALUE c[(int)(TASK_EVAL_ZOOM * 2.)], x, y, v, pol;
+    double x1[(int)(TASK_EVAL_ZOOM * 2.)], y1[(int)(TASK_EVAL_ZOOM * 2.)];
+    double x2[(int)(TASK_EVAL_ZOOM * 2.)], y2[(int)(TASK_EVAL_ZOOM * 2.)];
     
-    for(i=0; i<TASK_EVAL_ZOOM*2.; i++) {
-        x = (i / TASK_EVAL_ZOOM) - 1.;
-        for(j=0; j<TASK_EVAL_ZOOM*2.; j++) {
-            y = (j / TASK_EVAL_ZOOM) - 1.;
-            v =task_get_value(task, x, y);
+    for(i=0; i<n; i++) {
+        c[i] = (i / TASK_EVAL_ZOOM) - 1.;
+        x1[i] = sin(task->x_freq1 * c[i] + task->x_phase1);
+        y1[i] = sin(task->y_freq1 * c[i] + task->y_phase1);
+        x2[i] = sin(task->x_freq2 * c[i] + task->x_phase2);
+        y2[i] = sin(task->y_freq2 * c[i] + task->y_phase2);
+    }
+    for(i=0; i<n; i++) {
+        x = c[i];
+        for(j=0; j<n; j++) {
+            y = c[j];
+            v = 0;
+            v += x1[i];
+            v += y1[j];
+            v += x2[i];
+            v += y2[j];
+            pol = sqrt(x*x + y*y);
+            v += sin(task->pol_freq * pol + task->pol_phase);
             if(v > 0) { num_pos++; }
             if(v < 0) { num_neg++; }
         }
@@ -814,24 +2393,164 @@ int task_evaluate(const struct task_t *task) {
 }
 
 
-// Initialise the surface
-void task_init(struct task_t *task) {
-#if CALCULATE_BASELINE
-    task->step = 0;
-#endif
-    while(1) {
-        task->x_freq1 = task_init_freq();
-        task->y_freq1 = task_init_freq();
-        task->x_freq1 = task_init_freq();
-        task->y_freq2 = task_init_freq();
-        task->pol_freq = task_init_freq();
-        task->x_phase1 = task_init_phase();
-        task->x_phase1 = task_init_phase();
-        task->y_phase2 = task_init_phase();
-        task->y_phase2 = task_init_phase();
-        task->pol_phase = task_init_phase();
+// Get a random coordinate value in (-1..1)
+TYPE_VALUE task_get_coord(struct task_t *task) {
+    return getrand(&task->rng) * 2. - 1.;
+}
+
+
+// Get the next random point and its value on the surface
+// Points are drawn and calculated TASK_BATCH at a time; they come from the random stream in the same order
+void task_next_point(struct task_t *task, TYPE_VALUE *x, TYPE_VALUE *y, TYPE_VALUE *v) {
+    int k;
+    if(task->batch_ix == task->batch_num) {
+        for(k=0; k<TASK_BATCH; k++) {
+            task->batch_x[k] = task_get_coord(task);
+            task->batch_y[k] = task_get_coord(task);
+        }
+#if TASK_SIGN_MAP
+        for(k=0; k<TASK_BATCH; k++) { task->batch_v[k] = task_get_sign(task, task->batch_x[k], task->batch_y[k]); }
+#else
+        task_get_values(task, TASK_BATCH, task->batch_x, task->batch_y, task->batch_v);
+#endif
+        task->batch_ix = 0;
+        task->batch_num = TASK_BATCH;
+    }
+    *x = task->batch_x[task->batch_ix];
+    *y = task->batch_y[task->batch_ix];
+    *v = task->batch_v[task->batch_ix];
+    task->batch_ix++;
+}
+
+
+#if CALCULATE_BASELINE
+// The cell of the baseline grid for a coordinate
+int task_baseline_cell(TYPE_VALUE c) {
+    int k = (c + 1.) * (BASELINE_GRID / 2.);
+    if(k < 0) { return 0; }
+    if(k >= BASELINE_GRID) { return BASELINE_GRID - 1; }
+    return k;
+}
+
+
+// Add an example to the baseline grid
+void task_baseline_add(struct task_t *task, int example) {
+    const TYPE_VALUE *xs = (example & 1 ? task->neg_x : task->pos_x);
+    const TYPE_VALUE *ys = (example & 1 ? task->neg_y : task->pos_y);
+    int cell = task_baseline_cell(ys[example / 2]) * BASELINE_GRID + task_baseline_cell(xs[example / 2]);
+    task->baseline_next[example] = task->baseline_head[cell];
+    task->baseline_head[cell] = example;
+}
+
+
+// Return the class (1 positive, 0 negative) of the example closest to x, y in the baseline grid, or -1 if there are none
+// Cells are visited in rings around the cell of the point until the rest cannot be closer
+// The answer is the same as if all examples were checked in order: of examples at the same distance the first one wins
+int task_baseline_closest(const struct task_t *task, TYPE_VALUE x, TYPE_VALUE y) {
+    int r, i, j, e, best = -1;
+    const int row = task_baseline_cell(y), col = task_baseline_cell(x);
+    const TYPE_VALUE *xs, *ys;
+    TYPE_VALUE d2, min_distance2 = 10.; // coordinates between -1 and 1
+    double gap;
+    
+    for(r=0; r<BASELINE_GRID; r++) {
+        // Cells in ring r are at least r-1 cells away (with some room for rounding)
+        gap = (r - 1) * 2. / BASELINE_GRID - 1e-6;
+        if(gap > 0 && gap * gap > min_distance2 * (1. + 1e-5)) { break; }
+        for(i=row-r; i<=row+r; i++) {
+            if(i < 0 || i >= BASELINE_GRID) { continue; }
+            for(j=col-r; j<=col+r; j+=(i == row-r || i == row+r ? 1 : 2*r)) {
+                if(j < 0 || j >= BASELINE_GRID) { continue; }
+                for(e=task->baseline_head[i * BASELINE_GRID + j]; e!=-1; e=task->baseline_next[e]) {
+                    xs = (e & 1 ? task->neg_x : task->pos_x);
+                    ys = (e & 1 ? task->neg_y : task->pos_y);
+                    d2 = (xs[e / 2] - x) * (xs[e / 2] - x) + (ys[e / 2] - y) * (ys[e / 2] - y);
+                    if(d2 < min_distance2 || (d2 == min_distance2 && e < best)) {
+                        best = e;
+                        min_distance2 = d2;
+                    }
+                }
+            }
+        }
+    }
+    if(best == -1) { return -1; }
+    return !(best & 1);
+}
+#endif
+
+
+// Make the training questions of a task
+// Each question has the coordinates of a positive point, the coordinates of a negative point, a question point and a target answer
+// Also counts how many questions a baseline strategy can answer
+void task_make_questions(struct task_t *task) {
+    TYPE_VALUE x, y, v;
+    int q, no_pos, no_neg;
+    
+    task->batch_ix = 0;
+    task->batch_num = 0;
+    task->target_1_num = 0;
+    task->baseline_correct = 0;
+#if CALCULATE_BASELINE
+    for(q=0; q<BASELINE_GRID*BASELINE_GRID; q++) { task->baseline_head[q] = -1; }
+#endif
+    for(q=0; q<STEPS; q++) {
+        no_pos = 1;
+        no_neg = 1;
+        while(no_pos || no_neg) {
+            task_next_point(task, &x, &y, &v);
+            if(v < 0) {
+                no_neg = 0;
+                task->neg_x[q] = x;
+                task->neg_y[q] = y;
+            }
+            else {
+                no_pos = 0;
+                task->pos_x[q] = x;
+                task->pos_y[q] = y;
+            }
+        }
+        task_next_point(task, &x, &y, &v);
+        task->question_x[q] = x;
+        task->question_y[q] = y;
+        task->target[q] = (v >= 0);
+        if(task->target[q]) { task->target_1_num++; } // stats
+        
+        // Use a baseline strategy to try to answer our own question
+        // The strategy is to respond with the class of the closes example seen so far
+        // TODO This does not take into account that the brains are aware of their own scores
+        // so can use the questions as well to learn the surface better. Can add this later.
+#if CALCULATE_BASELINE
+        task->baseline_correct += (task->target[q] == task_baseline_closest(task, x, y));
+        task_baseline_add(task, 2 * q);
+        task_baseline_add(task, 2 * q + 1);
+#else
+        task->baseline_correct += -1;
+#endif
+    }
+}
+
+
+// Initialise the surface and make the questions
+// The task gets its own random stream for the given generation and task number
+void task_init(struct task_t *task, int generation, int task_no) {
+    rng_init(&task->rng, RNG_TASK, generation, task_no);
+    while(1) {
+        task->x_freq1 = task_init_freq(&task->rng);
+        task->y_freq1 = task_init_freq(&task->rng);
+        task->x_freq1 = task_init_freq(&task->rng);
+        task->y_freq2 = task_init_freq(&task->rng);
+        task->pol_freq = task_init_freq(&task->rng);
+        task->x_phase1 = task_init_phase(&task->rng);
+        task->x_phase1 = task_init_phase(&task->rng);
+        task->y_phase2 = task_init_phase(&task->rng);
+        task->y_phase2 = task_init_phase(&task->rng);
+        task->pol_phase = task_init_phase(&task->rng);
         if(task_evaluate(task)) { break; }
     }
+#if TASK_SIGN_MAP
+    task_make_sign_map(task); // only for the surface we keep; task_evaluate calculates the grid directly
+#endif
+    task_make_questions(task);
 }
 
 
@@ -849,366 +2568,2149 @@ void task_plot(
     char c;
     TYPE_VALUE zoom = 20., x, y;
     
-    for(i=0; i<zoom*2.; i++) {
-        x = (i / zoom) - 1.;
-        for(j=0; j<zoom*2.; j++) {
-            y = (j / zoom) - 1.;
-            c = (task_get_value(task, x, y) >= 0 ? '#' : '-');
-            printf("%c", c);
-            if(fabs(x-x1) < .05 && fabs(y-y1) < .05) { c = '1'; }
-            if(fabs(x-x2) < .05 && fabs(y-y2) < .05) { c = '2'; }
-            if(fabs(x-x3) < .05 && fabs(y-y3) < .05) { c = 'Q'; }
-            printf("%c", c);
-        }
-        printf("\n");
+    for(i=0; i<zoom*2.; i++) {
+        x = (i / zoom) - 1.;
+        for(j=0; j<zoom*2.; j++) {
+            y = (j / zoom) - 1.;
+            c = (task_get_sign(task, x, y) >= 0 ? '#' : '-');
+            printf("%c", c);
+            if(fabs(x-x1) < .05 && fabs(y-y1) < .05) { c = '1'; }
+            if(fabs(x-x2) < .05 && fabs(y-y2) < .05) { c = '2'; }
+            if(fabs(x-x3) < .05 && fabs(y-y3) < .05) { c = 'Q'; }
+            printf("%c", c);
+        }
+        printf("\n");
+    }
+}
+
+
+// Test the task code by printing sample surfaces
+void task_test(void) {
+    struct task_t *task = task_alloc();
+    task_init(task, 0, 0);
+    task_plot(task, 0,0,0,0,0,0);
+}
+
+
+// ==== EVALUATE ===================================================================================================================
+
+// Number of brains a thread takes at a time
+#define EVALUATE_CHUNK 4
+
+// An evaluation shared by the threads
+struct evaluate_job_t {
+    struct brain_t *brainpool;
+    TYPE_VALUE *results;
+    int best_brain;
+    const int *same_as; // brains with identical genes: only same_as[i] == i is evaluated (see genes_find_duplicates)
+    int generation; // for the random streams
+    int task_no;
+    const struct task_t *task; // the questions
+    // The brains answer questions question_from..question_to-1
+    int question_from;
+    int question_to;
+    int active[POOL_SIZE]; // the brains still evaluated
+    int active_num;
+    int next_brain; // next index in active for the threads to take
+    int best_brain_1_num; // stats (only written by the thread evaluating the best brain)
+    int best_brain_correct_num;
+};
+
+
+// Compare numbers
+static int cmpint(const void *p1, const void *p2) { return ( *((TYPE_VALUE*)p1) > *((TYPE_VALUE*)p2) ) - ( *((TYPE_VALUE*)p1) < *((TYPE_VALUE*)p2) ); }
+
+
+// State of racing in a generation
+struct race_t {
+    int on;
+    const TYPE_VALUE *penalty;
+    int answered[POOL_SIZE]; // number of questions answered in this generation
+    char stopped[POOL_SIZE];
+    char offspring[POOL_SIZE]; // brains created in the previous generation, which are prescreened
+    int brain_num; // brains evaluated, i.e. not duplicates (see same_as in struct evaluate_job_t)
+    int stopped_num; // stats
+    int prescreened_num;
+    long answered_num;
+};
+
+__thread struct race_t race = {.on = 0}; // of the island (see ISLANDS)
+
+
+// Start racing in a new generation
+void race_start(const TYPE_VALUE *penalty, const int *same_as) {
+    int i;
+    race.penalty = penalty;
+    race.brain_num = 0;
+    for(i=0; i<POOL_SIZE; i++) {
+        race.answered[i] = 0;
+        race.stopped[i] = 0;
+        if(same_as[i] == i) { race.brain_num++; }
+    }
+    race.stopped_num = 0;
+    race.prescreened_num = 0;
+    race.answered_num = 0;
+}
+
+
+// Stop the brains that cannot reach the keep limit with reasonable confidence
+// The limit is estimated from the scores the brains would get if they kept their current ratio of correct answers.
+// The standard deviation of one answer is at most 1/2, which gives the bounds around that ratio.
+// The best brain of the previous generation is not stopped because its answers are reported.
+// Brains that are the same as another one follow that one (see evaluate_share).
+void race_check(TYPE_VALUE *results, int best_brain, int offspring_only, const int *same_as) {
+    int i, remaining;
+    TYPE_VALUE ratio, eps, upper, limit;
+    TYPE_VALUE projected[POOL_SIZE];
+    
+    for(i=0; i<POOL_SIZE; i++) {
+        projected[i] = results[i] - race.penalty[i];
+        if(!race.stopped[i]) { projected[i] += (TASK_NUM * STEPS - race.answered[i]) * results[i] / race.answered[i]; }
+    }
+    qsort(projected, POOL_SIZE, sizeof(TYPE_VALUE), cmpint);
+    limit = projected[POOL_SIZE - POOL_KEEP];
+    
+    for(i=0; i<POOL_SIZE; i++) {
+        if(race.stopped[i] || i == best_brain || same_as[i] != i || (offspring_only && !race.offspring[i])) { continue; }
+        remaining = TASK_NUM * STEPS - race.answered[i];
+        ratio = results[i] / race.answered[i];
+        eps = RACING_Z * .5 / sqrt(race.answered[i]);
+        upper = results[i] + remaining * (ratio + eps < 1. ? ratio + eps : 1.) - race.penalty[i];
+        if(upper < limit) {
+            results[i] += remaining * (ratio - eps > 0. ? ratio - eps : 0.);
+            race.stopped[i] = 1;
+            race.stopped_num++;
+            if(offspring_only) { race.prescreened_num++; }
+        }
+    }
+}
+
+
+// Let one brain answer the questions of the job
+void evaluate_brain(struct evaluate_job_t *job, int i) {
+    int question_num, think, answer, target;
+    struct brain_t *brain = &job->brainpool[i];
+    TYPE_VALUE thinking_time_v = brain->thinking_time;
+    TYPE_VALUE input_state[NUM_INPUTS];
+    struct rng_t rng;
+    
+    if(job->question_from == 0) {
+        rng_init(&rng, RNG_PLAY, job->generation, job->task_no * POOL_SIZE + i);
+        brain_play_init(brain, &rng);
+    }
+    // results[i] = 0; -- initialised elsewhere
+    
+    input_state[6] = 0; // results[i]; (Values are too big)
+    input_state[8] = 1.; // bias
+    
+    for(question_num=job->question_from; question_num<job->question_to; question_num++) { // Loop through questions
+        input_state[0] = job->task->pos_x[question_num];
+        input_state[1] = job->task->pos_y[question_num];
+        input_state[2] = job->task->neg_x[question_num];
+        input_state[3] = job->task->neg_y[question_num];
+        input_state[4] = job->task->question_x[question_num];
+        input_state[5] = job->task->question_y[question_num];
+        target = job->task->target[question_num];
+        // Debug: task_plot(task, brain->input_state[0], brain->input_state[1], brain->input_state[2], brain->input_state[3], brain->input_state[4], brain->input_state[5]);
+        
+        for(think = 0; think < thinking_time_v; think++) { // Loop thinking
+            input_state[7] = ((TYPE_VALUE)think) / thinking_time_v; // clock
+            brain_play_step(brain, input_state);
+        }
+        
+        answer = (brain_get_output(brain) >= 0);
+        if(answer == target) { job->results[i]++; }
+        // if(i == best_brain) { printf("Best brain: %d Question: %d Answer: %d Target: %d Result: %f\n", i, question_num, answer, target, results[i]); }
+        if(i == job->best_brain) { 
+            if(answer) { job->best_brain_1_num++; }
+            if(answer == target) { job->best_brain_correct_num++; }
+        }
+    }
+}
+
+
+// Thread body for evaluate
+void evaluate_worker(void *arg, int thread_ix) {
+    struct evaluate_job_t *job = arg;
+    int first, k;
+    while(1) {
+        first = threads_take(&job->next_brain, EVALUATE_CHUNK);
+        if(first >= job->active_num) { break; }
+        for(k=first; k<first+EVALUATE_CHUNK && k<job->active_num; k++) { evaluate_brain(job, job->active[k]); }
+    }
+}
+
+
+// Give the brains that were not evaluated the results of the same brain that was
+void evaluate_share(struct evaluate_job_t *job) {
+    int i;
+    for(i=0; i<POOL_SIZE; i++) {
+        if(job->same_as[i] == i) { continue; }
+        job->results[i] = job->results[job->same_as[i]];
+        if(race.on) {
+            race.answered[i] = race.answered[job->same_as[i]];
+            race.stopped[i] = race.stopped[job->same_as[i]];
+        }
+    }
+}
+
+
+// Log how the best brain of the previous generation did in a task
+void evaluate_log(int best_brain, int target_1_num, int best_brain_1_num, int best_brain_correct_num, int baseline_correct) {
+    fprintf(stderr, "Task: Prev best brain: %d Target=1ratio: %f Answer=1ratio: %f CorrectRatio: %f BaselineCorrectRatio: %f\n", best_brain, ((TYPE_VALUE)target_1_num) / STEPS, ((TYPE_VALUE)best_brain_1_num) / STEPS, ((TYPE_VALUE)best_brain_correct_num) / STEPS, ((TYPE_VALUE)baseline_correct) / STEPS);
+}
+
+
+// Evaluate brains against a task. They need to learn and respond
+// The energy of the brains (related to correct answers) is added to results
+// The brains are independent, so they are shared out between the threads
+// generation and task_no select the random streams for the brains
+// When racing, the questions are answered in parts, and race_check is called between them
+// Only one of the brains that are the same is evaluated (see same_as in struct evaluate_job_t)
+void evaluate(struct brain_t *brainpool, struct task_t *task, TYPE_VALUE *results, int best_brain, const int *same_as, int generation, int task_no) {
+    int i;
+    struct evaluate_job_t *job = malloc(sizeof(struct evaluate_job_t));
+    if(job == NULL) { die("Out of memory"); }
+    
+    job->brainpool = brainpool;
+    job->results = results;
+    job->best_brain = (best_brain >= 0 ? same_as[best_brain] : -1); // its answers are the same
+    job->same_as = same_as;
+    job->generation = generation;
+    job->task_no = task_no;
+    job->task = task;
+    job->best_brain_1_num = 0;
+    job->best_brain_correct_num = 0;
+    
+    job->question_to = 0;
+    while(job->question_to < STEPS) {
+        job->question_from = job->question_to;
+        job->question_to = STEPS;
+        if(race.on) {
+            if(job->task_no == 0 && job->question_from < RACING_PRESCREEN) { job->question_to = RACING_PRESCREEN; }
+            else if(job->question_from / RACING_CHECKPOINT + 1 < STEPS / RACING_CHECKPOINT) { job->question_to = (job->question_from / RACING_CHECKPOINT + 1) * RACING_CHECKPOINT; }
+        }
+        
+        job->active_num = 0;
+        for(i=0; i<POOL_SIZE; i++) {
+            if(same_as[i] != i || (race.on && race.stopped[i])) { continue; }
+            job->active[job->active_num++] = i;
+        }
+        job->next_brain = 0;
+        threads_run(evaluate_worker, job);
+        
+        if(race.on) {
+            for(i=0; i<job->active_num; i++) { race.answered[job->active[i]] += job->question_to - job->question_from; }
+            race.answered_num += (long)job->active_num * (job->question_to - job->question_from);
+        }
+        evaluate_share(job);
+        if(race.on && job->question_to < STEPS) {
+            race_check(results, job->best_brain, job->task_no == 0 && job->question_to < RACING_CHECKPOINT, same_as);
+            evaluate_share(job);
+        }
+    }
+    
+    evaluate_log(best_brain, task->target_1_num, job->best_brain_1_num, job->best_brain_correct_num, task->baseline_correct);
+    free(job);
+}
+
+
+// ==== METRICS ==================================================================================================================
+// Measurements of each generation, written as JSON lines (--metrics FILE, prefixed like the checkpoints with islands)
+// The phases are timed with a monotonic clock in the thread of the island, so they show where the time of a
+// generation goes. Building brains is mostly done by the threads while breeding, so its time (create_brain)
+// is summed over the threads, and is also part of the time of the breeding (clone_mutate) and the crossover.
+// The counters are about the brains that were evaluated (duplicates are only evaluated once, see same_as)
+
+#define METRICS_TASK_INIT 0
+#define METRICS_EVALUATE 1
+#define METRICS_SELECT 2
+#define METRICS_CLONE_MUTATE 3
+#define METRICS_CREATE_BRAIN 4
+#define METRICS_CROSSOVER 5
+#define METRICS_CHECKPOINT 6
+#define METRICS_XPOL 7
+#define METRICS_PHASES 8
+
+const char *metrics_phase_names[METRICS_PHASES] = { "task_init", "evaluate", "select", "clone_mutate", "create_brain", "crossover", "checkpoint", "xpol" };
+
+struct metrics_t {
+    FILE *file;
+    int island;
+    double generation_start;
+    double phase[METRICS_PHASES]; // seconds in this generation
+    // counters of the evaluation
+    long long brain_steps; // calls of brain_play_step
+    long long weight_edges; // compiled connections processed in them (see brain_compile)
+    int brain_num;
+    double brain_weights_avg;
+    int brain_weights_max;
+    int genes_length[7]; // min, p10, p25, p50, p75, p90, max
+    double genes_length_avg;
+};
+
+__thread struct metrics_t metrics = { .file = NULL }; // of the island (see ISLANDS)
+
+
+// The monotonic clock in seconds
+double metrics_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+
+// Add the time since start to a phase
+void metrics_add(int phase, double start) {
+    metrics.phase[phase] += metrics_now() - start;
+}
+
+
+void metrics_open(const char *filename, int island) {
+    metrics.file = fopen(filename, "a");
+    if(metrics.file == NULL) { die("Cannot open metrics file"); }
+    metrics.island = island;
+    metrics.generation_start = metrics_now();
+}
+
+
+// Compare numbers
+static int metrics_cmpint(const void *p1, const void *p2) { return ( *((int*)p1) > *((int*)p2) ) - ( *((int*)p1) < *((int*)p2) ); }
+
+
+// Count the work of the evaluation that has just been done
+// Each question makes a brain think for thinking_time steps, rounded up (see evaluate_brain), and each step
+// processes all the compiled connections of the brain
+void metrics_count(const struct genes_t *genepool, const struct brain_t *brainpool, const int *same_as) {
+    int i, questions, weights, edges, lengths[POOL_SIZE];
+    long long steps, weights_sum = 0, lengths_sum = 0;
+    if(metrics.file == NULL) { return; }
+    
+    metrics.brain_steps = 0;
+    metrics.weight_edges = 0;
+    metrics.brain_num = 0;
+    metrics.brain_weights_max = 0;
+    for(i=0; i<POOL_SIZE; i++) {
+        lengths[i] = genepool[i].length;
+        lengths_sum += lengths[i];
+        if(same_as[i] != i) { continue; }
+        questions = (race.on ? race.answered[i] : TASK_NUM * STEPS);
+        weights = brainpool[i].weight_num - 1; // the live weights
+        edges = brainpool[i].in_global_num + brainpool[i].in_sumsi_num + brainpool[i].out_edge_num + brainpool[i].ctrl_weight_num + brainpool[i].ctrl_sumsi_num;
+        steps = (long long)questions * (long long)ceil(brainpool[i].thinking_time);
+        metrics.brain_steps += steps;
+        metrics.weight_edges += steps * edges;
+        metrics.brain_num++;
+        weights_sum += weights;
+        if(weights > metrics.brain_weights_max) { metrics.brain_weights_max = weights; }
+    }
+    metrics.brain_weights_avg = (double)weights_sum / metrics.brain_num;
+    
+    qsort(lengths, POOL_SIZE, sizeof(int), metrics_cmpint);
+    metrics.genes_length[0] = lengths[0];
+    metrics.genes_length[1] = lengths[POOL_SIZE / 10];
+    metrics.genes_length[2] = lengths[POOL_SIZE / 4];
+    metrics.genes_length[3] = lengths[POOL_SIZE / 2];
+    metrics.genes_length[4] = lengths[POOL_SIZE * 3 / 4];
+    metrics.genes_length[5] = lengths[POOL_SIZE * 9 / 10];
+    metrics.genes_length[6] = lengths[POOL_SIZE - 1];
+    metrics.genes_length_avg = (double)lengths_sum / POOL_SIZE;
+}
+
+
+// Write the line of the generation and start measuring the next one
+void metrics_write(int generation) {
+    int p;
+    double now = metrics_now(), evaluate_time = metrics.phase[METRICS_EVALUATE];
+    if(metrics.file == NULL) { return; }
+    
+    fprintf(metrics.file, "{\"island\":%d,\"generation\":%d,\"time\":%.6f", metrics.island, generation, now - metrics.generation_start);
+    for(p=0; p<METRICS_PHASES; p++) { fprintf(metrics.file, ",\"%s_time\":%.6f", metrics_phase_names[p], metrics.phase[p]); }
+    fprintf(metrics.file, ",\"brains_evaluated\":%d,\"brain_steps\":%lld,\"brain_steps_per_s\":%.0f,\"weight_edges\":%lld,\"weight_edges_per_s\":%.0f",
+        metrics.brain_num, metrics.brain_steps, (evaluate_time > 0 ? metrics.brain_steps / evaluate_time : 0.),
+        metrics.weight_edges, (evaluate_time > 0 ? metrics.weight_edges / evaluate_time : 0.));
+    fprintf(metrics.file, ",\"brain_weights_avg\":%.2f,\"brain_weights_max\":%d", metrics.brain_weights_avg, metrics.brain_weights_max);
+    fprintf(metrics.file, ",\"genes_length\":{\"min\":%d,\"p10\":%d,\"p25\":%d,\"p50\":%d,\"p75\":%d,\"p90\":%d,\"max\":%d,\"avg\":%.2f}}\n",
+        metrics.genes_length[0], metrics.genes_length[1], metrics.genes_length[2], metrics.genes_length[3],
+        metrics.genes_length[4], metrics.genes_length[5], metrics.genes_length[6], metrics.genes_length_avg);
+    fflush(metrics.file);
+    
+    for(p=0; p<METRICS_PHASES; p++) { metrics.phase[p] = 0; }
+    metrics.generation_start = now;
+}
+
+// =======================================================================================================================
+
+
+// ==== CHECKPOINT ===============================================================================================================
+// The gene pool is saved into a binary file that is mapped into memory when loaded:
+// a header, an entry for each genes, then the commands of all genes as (command, arg) pairs.
+// The file is written under a temporary name and renamed, so a crash never leaves a broken checkpoint.
+// Between these full checkpoints, the genes changed in each generation are appended to a journal:
+// a header with the checksum of the full checkpoint it belongs to, then a record for each generation
+// (a record header, entries, commands). Loading replays the journal on top of the full checkpoint.
+// Checkpoints are written by a background thread from a snapshot of the pool (see checkpoint_start)
+
+#define CHECKPOINT_INTERVAL 10 // generations between full checkpoints
+#define CHECKPOINT_FILE "genepool.dat"
+#define CHECKPOINT_JOURNAL 1 // Write the changed genes into the journal in the generations between full checkpoints
+#define CHECKPOINT_JOURNAL_FILE "genepool.journal"
+#define CHECKPOINT_TEXT 0 // Also write the gene pool in the text format (with the readable genes) at each full checkpoint
+#define CHECKPOINT_TEXT_FILE "genepool.txt"
+#define CHECKPOINT_MAGIC "RBEPOOL"
+#define CHECKPOINT_JOURNAL_MAGIC "RBEJRNL"
+#define CHECKPOINT_RECORD_MAGIC 0x44524352
+#define CHECKPOINT_VERSION 1
+
+struct checkpoint_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t pool_size;
+    uint64_t command_num; // in all the genes
+    uint64_t checksum; // of everything after the header (see checkpoint_checksum)
+};
+
+struct checkpoint_entry_t {
+    uint64_t first; // first command of the genes
+    uint32_t length;
+    uint32_t slot; // place of the genes in the pool
+    double learning_rate;
+    double thinking_time;
+};
+
+struct checkpoint_journal_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t pool_size;
+    uint64_t base_checksum; // checksum of the full checkpoint the journal belongs to
+    uint64_t reserved;
+};
+
+struct checkpoint_record_t {
+    uint32_t magic;
+    uint32_t entry_num;
+    uint64_t command_num;
+    uint64_t generation;
+    uint64_t checksum; // of the entries and commands of the record
+};
+
+// A checkpoint (and its journal) mapped into memory
+struct checkpoint_t {
+    void *map;
+    size_t size;
+    void *journal_map;
+    size_t journal_size;
+    const struct checkpoint_header_t *header;
+    const struct checkpoint_entry_t *entries[POOL_SIZE]; // the latest entry for each genes
+    const struct genes_command_t *commands[POOL_SIZE]; // the commands of these entries
+};
+
+
+// Checksum of size bytes (a multiple of 8) in four independent streams so that it is fast
+uint64_t checkpoint_checksum(const void *data, size_t size) {
+    const uint64_t *words = data;
+    size_t i, n = size / sizeof(uint64_t);
+    uint64_t h[4] = { 1, 2, 3, 4 };
+    for(i=0; i+4<=n; i+=4) {
+        h[0] = rng_mix(h[0] ^ words[i]);
+        h[1] = rng_mix(h[1] ^ words[i+1]);
+        h[2] = rng_mix(h[2] ^ words[i+2]);
+        h[3] = rng_mix(h[3] ^ words[i+3]);
+    }
+    for(; i<n; i++) { h[0] = rng_mix(h[0] ^ words[i]); }
+    return rng_mix(h[0] + rng_mix(h[1] + rng_mix(h[2] + rng_mix(h[3] + n))));
+}
+
+
+// Copy the commands of the genes into the entry and commands to be written
+// Returns the number of commands
+int checkpoint_pack(const struct genes_t *genes, int slot, uint64_t first, struct checkpoint_entry_t *entry, struct genes_command_t *commands) {
+    int c, pos = 0;
+    entry->first = first;
+    entry->length = genes->length;
+    entry->slot = slot;
+    entry->learning_rate = genes->learning_rate;
+    entry->thinking_time = genes->thinking_time;
+    for(c=0; c<genes->chunk_num; c++) {
+        memcpy(&commands[first + pos], genes->chunks[c]->commands, genes->chunks[c]->length * sizeof(struct genes_command_t));
+        pos += genes->chunks[c]->length;
+    }
+    return pos;
+}
+
+
+// Write size bytes into the file and make sure they are on the disk
+void checkpoint_write(FILE *outfile, const void *buf, size_t size) {
+    if(fwrite(buf, 1, size, outfile) != size || fflush(outfile) != 0 || fsync(fileno(outfile)) != 0) { die("Error while writing file"); }
+}
+
+
+// Write a file under a temporary name and rename it
+void checkpoint_write_file(const char *filename, const void *buf, size_t size) {
+    char tmp_filename[256];
+    FILE *outfile;
+    if(snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename) >= (int)sizeof(tmp_filename)) { die("File name too long"); }
+    outfile = fopen(tmp_filename, "wb");
+    if(outfile == NULL) { die("Cannot open file"); }
+    checkpoint_write(outfile, buf, size);
+    fclose(outfile);
+    if(rename(tmp_filename, filename) != 0) { die("Cannot rename file"); }
+}
+
+
+// Save the gene pool into a binary file
+// Returns the checksum of the file (which journals refer to)
+uint64_t checkpoint_save(const struct genes_t *genepool, const char *filename) {
+    uint64_t command_num = 0, pos = 0, checksum;
+    size_t size;
+    int i;
+    char *buf;
+    struct checkpoint_header_t *header;
+    struct checkpoint_entry_t *entries;
+    struct genes_command_t *commands;
+    
+    for(i=0; i<POOL_SIZE; i++) { command_num += genepool[i].length; }
+    size = sizeof(struct checkpoint_header_t) + POOL_SIZE * sizeof(struct checkpoint_entry_t) + command_num * sizeof(struct genes_command_t);
+    buf = calloc(1, size);
+    if(buf == NULL) { die("Out of memory"); }
+    header = (struct checkpoint_header_t *)buf;
+    entries = (struct checkpoint_entry_t *)(header + 1);
+    commands = (struct genes_command_t *)(entries + POOL_SIZE);
+    
+    memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    header->version = CHECKPOINT_VERSION;
+    header->pool_size = POOL_SIZE;
+    header->command_num = command_num;
+    for(i=0; i<POOL_SIZE; i++) { pos += checkpoint_pack(&genepool[i], i, pos, &entries[i], commands); }
+    checksum = header->checksum = checkpoint_checksum(header + 1, size - sizeof(struct checkpoint_header_t));
+    checkpoint_write_file(filename, buf, size);
+    free(buf);
+    return checksum;
+}
+
+
+// Start a new, empty journal for the full checkpoint with the given checksum
+void checkpoint_journal_start(const char *filename, uint64_t base_checksum) {
+    struct checkpoint_journal_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_JOURNAL_MAGIC, sizeof(CHECKPOINT_JOURNAL_MAGIC));
+    header.version = CHECKPOINT_VERSION;
+    header.pool_size = POOL_SIZE;
+    header.base_checksum = base_checksum;
+    checkpoint_write_file(filename, &header, sizeof(header));
+}
+
+
+// Append a record with the genes in the given slots to the journal
+// A record cut short by a crash fails its checksum and is ignored when the journal is replayed
+void checkpoint_journal_append(const char *filename, const struct genes_t *genepool, const int *slots, int slot_num, int generation) {
+    uint64_t command_num = 0, pos = 0;
+    size_t size;
+    int k;
+    char *buf;
+    struct checkpoint_record_t *record;
+    struct checkpoint_entry_t *entries;
+    struct genes_command_t *commands;
+    FILE *outfile;
+    
+    for(k=0; k<slot_num; k++) { command_num += genepool[slots[k]].length; }
+    size = sizeof(struct checkpoint_record_t) + slot_num * sizeof(struct checkpoint_entry_t) + command_num * sizeof(struct genes_command_t);
+    buf = calloc(1, size);
+    if(buf == NULL) { die("Out of memory"); }
+    record = (struct checkpoint_record_t *)buf;
+    entries = (struct checkpoint_entry_t *)(record + 1);
+    commands = (struct genes_command_t *)(entries + slot_num);
+    
+    record->magic = CHECKPOINT_RECORD_MAGIC;
+    record->entry_num = slot_num;
+    record->command_num = command_num;
+    record->generation = generation;
+    for(k=0; k<slot_num; k++) { pos += checkpoint_pack(&genepool[slots[k]], slots[k], pos, &entries[k], commands); }
+    record->checksum = checkpoint_checksum(record + 1, size - sizeof(struct checkpoint_record_t));
+    
+    outfile = fopen(filename, "ab");
+    if(outfile == NULL) { die("Cannot open file"); }
+    checkpoint_write(outfile, buf, size);
+    fclose(outfile);
+    free(buf);
+}
+
+
+// Map a binary gene pool file into memory and check it
+void checkpoint_open(struct checkpoint_t *checkpoint, const char *filename) {
+    struct stat st;
+    const struct checkpoint_header_t *header;
+    const struct checkpoint_entry_t *entries;
+    const struct genes_command_t *commands;
+    uint64_t command_num;
+    int fd = open(filename, O_RDONLY);
+    
+    if(fd < 0) { die("Cannot open file"); }
+    if(fstat(fd, &st) != 0) { die("Cannot open file"); }
+    checkpoint->size = st.st_size;
+    if(checkpoint->size < sizeof(struct checkpoint_header_t)) { die("Genepool file too short"); }
+    checkpoint->map = mmap(NULL, checkpoint->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(checkpoint->map == MAP_FAILED) { die("Cannot map file"); }
+    
+    header = checkpoint->header = checkpoint->map;
+    if(memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0) {
+        if(memcmp(header->magic, "genepool", 8) == 0) { die("Genepool file is text - convert it with --convert"); }
+        die("Genepool signature error");
+    }
+    if(header->version != CHECKPOINT_VERSION) { die("Genepool version mismatch"); }
+    if(header->pool_size != POOL_SIZE) { die("Pool size mismatch"); }
+    command_num = header->command_num;
+    if(checkpoint->size != sizeof(struct checkpoint_header_t) + POOL_SIZE * sizeof(struct checkpoint_entry_t) + command_num * sizeof(struct genes_command_t)) {
+        die("Genepool file size mismatch");
+    }
+    if(header->checksum != checkpoint_checksum(header + 1, checkpoint->size - sizeof(struct checkpoint_header_t))) { die("Genepool checksum error"); }
+    entries = (const struct checkpoint_entry_t *)(header + 1);
+    commands = (const struct genes_command_t *)(entries + POOL_SIZE);
+    for(int i=0; i<POOL_SIZE; i++) {
+        if(entries[i].length < 1 || entries[i].length > command_num || entries[i].first > command_num - entries[i].length) {
+            die("Genepool entry error");
+        }
+        checkpoint->entries[i] = &entries[i];
+        checkpoint->commands[i] = &commands[entries[i].first];
+    }
+    checkpoint->journal_map = NULL;
+}
+
+
+// Replay the journal of the checkpoint, if there is one: the genes in its records replace the ones in the checkpoint
+// Records after a broken one (cut short by a crash) are ignored
+void checkpoint_journal_replay(struct checkpoint_t *checkpoint, const char *filename) {
+    struct stat st;
+    const struct checkpoint_journal_header_t *header;
+    const struct checkpoint_record_t *record;
+    const struct checkpoint_entry_t *entries;
+    const struct genes_command_t *commands;
+    size_t pos, size;
+    int k, record_num = 0, genes_num = 0;
+    int fd = open(filename, O_RDONLY);
+    
+    if(fd < 0) { return; }
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct checkpoint_journal_header_t)) {
+        close(fd);
+        fprintf(stderr, "Journal: too short, ignored\n");
+        return;
+    }
+    checkpoint->journal_size = st.st_size;
+    checkpoint->journal_map = mmap(NULL, checkpoint->journal_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(checkpoint->journal_map == MAP_FAILED) { die("Cannot map file"); }
+    
+    header = checkpoint->journal_map;
+    if(memcmp(header->magic, CHECKPOINT_JOURNAL_MAGIC, sizeof(CHECKPOINT_JOURNAL_MAGIC)) != 0 || header->version != CHECKPOINT_VERSION || header->pool_size != POOL_SIZE) {
+        die("Journal signature error");
+    }
+    if(header->base_checksum != checkpoint->header->checksum) {
+        fprintf(stderr, "Journal: belongs to another checkpoint, ignored\n");
+        return;
+    }
+    
+    pos = sizeof(struct checkpoint_journal_header_t);
+    while(pos < checkpoint->journal_size) {
+        record = (const struct checkpoint_record_t *)((const char *)checkpoint->journal_map + pos);
+        if(checkpoint->journal_size - pos < sizeof(struct checkpoint_record_t) || record->magic != CHECKPOINT_RECORD_MAGIC) { break; }
+        if(record->entry_num > POOL_SIZE || record->command_num > (checkpoint->journal_size - pos) / sizeof(struct genes_command_t)) { break; }
+        size = sizeof(struct checkpoint_record_t) + record->entry_num * sizeof(struct checkpoint_entry_t) + record->command_num * sizeof(struct genes_command_t);
+        if(size > checkpoint->journal_size - pos) { break; }
+        if(record->checksum != checkpoint_checksum(record + 1, size - sizeof(struct checkpoint_record_t))) { break; }
+        entries = (const struct checkpoint_entry_t *)(record + 1);
+        commands = (const struct genes_command_t *)(entries + record->entry_num);
+        for(k=0; k<(int)record->entry_num; k++) {
+            if(entries[k].slot >= POOL_SIZE || entries[k].length < 1 || entries[k].length > record->command_num || entries[k].first > record->command_num - entries[k].length) {
+                die("Journal entry error");
+            }
+        }
+        for(k=0; k<(int)record->entry_num; k++) {
+            checkpoint->entries[entries[k].slot] = &entries[k];
+            checkpoint->commands[entries[k].slot] = &commands[entries[k].first];
+        }
+        record_num++;
+        genes_num += record->entry_num;
+        pos += size;
+    }
+    fprintf(stderr, "Journal: replayed %d records with %d genes\n", record_num, genes_num);
+    if(pos < checkpoint->journal_size) { fprintf(stderr, "Journal: broken record at the end ignored\n"); }
+}
+
+
+// Get genes from an entry and its commands
+void checkpoint_entry_genes(const struct checkpoint_entry_t *entry, const struct genes_command_t *commands, struct genes_t *genes) {
+    struct genes_builder_t builder;
+    genes_builder_begin(&builder, entry->length);
+    genes_builder_add_commands(&builder, commands, entry->length);
+    genes_builder_end(&builder, genes);
+    genes->learning_rate = entry->learning_rate;
+    genes->thinking_time = entry->thinking_time;
+    genes->changed_from = 0;
+}
+
+
+// Get genes i from the checkpoint
+void checkpoint_genes(const struct checkpoint_t *checkpoint, int i, struct genes_t *genes) {
+    checkpoint_entry_genes(checkpoint->entries[i], checkpoint->commands[i], genes);
+}
+
+
+void checkpoint_close(struct checkpoint_t *checkpoint) {
+    munmap(checkpoint->map, checkpoint->size);
+    checkpoint->map = NULL;
+    if(checkpoint->journal_map != NULL && checkpoint->journal_map != MAP_FAILED) { munmap(checkpoint->journal_map, checkpoint->journal_size); }
+    checkpoint->journal_map = NULL;
+}
+
+
+// Write the gene pool in the text format: the readable genes, then the genes again for reading back
+void genepool_write_text(const struct genes_t *genepool, const char *filename) {
+    FILE *outfile = fopen(filename, "w+");
+    if(outfile == NULL) { die("Cannot open file"); }
+    fprintf(outfile, "genepool_v1\n# Pool size:\n%d\n", POOL_SIZE);
+    for(int i=0; i<POOL_SIZE; i++) { genes_write(&genepool[i], outfile, 1); }
+    for(int i=0; i<POOL_SIZE; i++) { genes_write(&genepool[i], outfile, 0); }
+    fclose(outfile);
+}
+
+
+// Read a gene pool in the text format
+void genepool_read_text(struct genes_t *genepool, const char *filename) {
+    FILE *outfile = fopen(filename, "r");
+    if(outfile == NULL) { die("Cannot open file"); }
+    size_t memlen = 0;
+    char *membuf = NULL;
+    int ret;
+    int lineno = 0;
+    int pool_size;
+    
+    while(1) {
+        ret = getline(&membuf, &memlen, outfile);
+        if(ret < 0) {
+            free(membuf);
+            die("Error while reading file");
+        }
+        if(membuf[0] == '#') { continue; }
+        if(ret > 100) { die("Line too long"); }
+        if(lineno == 0 && strcmp(membuf, "genepool_v1\n") != 0) { die("Genepool signature error"); }
+        if(lineno == 1) {
+            if(sscanf(membuf, "%d", &pool_size) != 1) { die("Genepool error 2"); }
+            if(pool_size != POOL_SIZE) { die("Pool size mismatch"); }
+            break;
+        }
+        lineno++;
+    }
+    for(int i=0; i<POOL_SIZE; i++) { genes_read(&genepool[i], outfile); }
+    free(membuf);
+    fclose(outfile);
+}
+
+
+// The background writer of checkpoints (each island has its own)
+struct checkpoint_writer_t {
+    char file[256]; // the names of the files written
+    char journal_file[256];
+    char text_file[256];
+    pthread_t thread;
+    int running; // a checkpoint is being written
+    int done; // the writer has finished (set by the writer)
+    int full; // write a full checkpoint, not a journal record
+    int has_base; // a full checkpoint has been written that the journal belongs to
+    int generation;
+    int slot_num;
+    int slots[POOL_SIZE]; // the genes in the snapshot
+    char dirty[POOL_SIZE]; // genes changed since they were last written (see checkpoint_mark)
+    struct genes_t *snapshot; // [POOL_SIZE] shares the chunks of the pool
+};
+__thread struct checkpoint_writer_t checkpoint_writer = { .file = CHECKPOINT_FILE, .journal_file = CHECKPOINT_JOURNAL_FILE, .text_file = CHECKPOINT_TEXT_FILE, .running = 0, .has_base = 0, .snapshot = NULL };
+
+
+// Prefix the names of the checkpoint files of the island
+void checkpoint_set_prefix(const char *prefix) {
+    snprintf(checkpoint_writer.file, sizeof(checkpoint_writer.file), "%s%s", prefix, CHECKPOINT_FILE);
+    snprintf(checkpoint_writer.journal_file, sizeof(checkpoint_writer.journal_file), "%s%s", prefix, CHECKPOINT_JOURNAL_FILE);
+    snprintf(checkpoint_writer.text_file, sizeof(checkpoint_writer.text_file), "%s%s", prefix, CHECKPOINT_TEXT_FILE);
+}
+
+
+// Note that genes i have changed and need to be in the next checkpoint
+void checkpoint_mark(int i) {
+    checkpoint_writer.dirty[i] = 1;
+}
+
+
+// The writer thread. arg is the writer of the island that started it
+void *checkpoint_writer_main(void *arg) {
+    struct checkpoint_writer_t *writer = arg;
+    int k;
+    if(writer->full) {
+        uint64_t checksum = checkpoint_save(writer->snapshot, writer->file);
+        if(CHECKPOINT_JOURNAL) { checkpoint_journal_start(writer->journal_file, checksum); }
+        if(CHECKPOINT_TEXT) { genepool_write_text(writer->snapshot, writer->text_file); }
+    }
+    else {
+        checkpoint_journal_append(writer->journal_file, writer->snapshot, writer->slots, writer->slot_num, writer->generation);
+    }
+    for(k=0; k<writer->slot_num; k++) { genes_clear(&writer->snapshot[writer->slots[k]]); }
+    __atomic_store_n(&writer->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+
+// Wait until the checkpoint being written (if any) is finished
+void checkpoint_wait(void) {
+    if(!checkpoint_writer.running) { return; }
+    if(pthread_join(checkpoint_writer.thread, NULL) != 0) { die("Cannot join checkpoint writer"); }
+    checkpoint_writer.running = 0;
+}
+
+
+// Start writing a checkpoint of the pool in the background: a full one, or a journal record of the genes marked
+// since the last checkpoint. The snapshot only shares the chunks of the genes, which are not changed while shared,
+// so the pool can evolve on. If the previous checkpoint is still being written, this waits for it first
+void checkpoint_start(const struct genes_t *genepool, int generation, int full) {
+    int i;
+    if(checkpoint_writer.running && !__atomic_load_n(&checkpoint_writer.done, __ATOMIC_ACQUIRE)) {
+        fprintf(stderr, "Checkpoint: waiting for the previous one to be written\n");
+    }
+    checkpoint_wait();
+    if(!CHECKPOINT_JOURNAL || !checkpoint_writer.has_base) { full = 1; }
+    if(checkpoint_writer.snapshot == NULL) { checkpoint_writer.snapshot = genes_alloc(POOL_SIZE); }
+    checkpoint_writer.slot_num = 0;
+    for(i=0; i<POOL_SIZE; i++) {
+        if(!full && !checkpoint_writer.dirty[i]) { continue; }
+        genes_clone(&genepool[i], &checkpoint_writer.snapshot[i]);
+        checkpoint_writer.slots[checkpoint_writer.slot_num++] = i;
+        checkpoint_writer.dirty[i] = 0;
+    }
+    checkpoint_writer.full = full;
+    checkpoint_writer.has_base = 1;
+    checkpoint_writer.generation = generation;
+    checkpoint_writer.done = 0;
+    if(pthread_create(&checkpoint_writer.thread, NULL, checkpoint_writer_main, &checkpoint_writer) != 0) { die("Cannot start checkpoint writer"); }
+    checkpoint_writer.running = 1;
+}
+
+
+// Convert a gene pool file between the binary and the text format. The format of the source is detected
+void checkpoint_convert(const char *from, const char *to) {
+    struct checkpoint_t checkpoint;
+    struct genes_t *genepool = genes_alloc(POOL_SIZE);
+    char magic[8] = { 0 };
+    FILE *infile = fopen(from, "rb");
+    if(infile == NULL) { die("Cannot open file"); }
+    if(fread(magic, 1, sizeof(magic), infile) != sizeof(magic)) { die("Error while reading file"); }
+    fclose(infile);
+    
+    if(memcmp(magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) == 0) {
+        fprintf(stderr, "Converting binary gene pool %s to text %s\n", from, to);
+        checkpoint_open(&checkpoint, from);
+        for(int i=0; i<POOL_SIZE; i++) { checkpoint_genes(&checkpoint, i, &genepool[i]); }
+        checkpoint_close(&checkpoint);
+        genepool_write_text(genepool, to);
+    }
+    else {
+        fprintf(stderr, "Converting text gene pool %s to binary %s\n", from, to);
+        genepool_read_text(genepool, from);
+        checkpoint_save(genepool, to);
+    }
+}
+
+
+// ==== BREED ====================================================================================================================
+
+// Number of offspring a thread takes at a time
+#define BREED_CHUNK 2
+
+// Whether brain a ranks below brain b: by result, and of brains with the same result the later one is lower
+static inline int select_below(const TYPE_VALUE *results, int a, int b) {
+    return results[a] < results[b] || (results[a] == results[b] && a > b);
+}
+
+
+// Reorder rank[from..to-1] so that rank[k] is the brain that belongs there in the ranking,
+// with the brains below it before it and the ones above it after it (quickselect)
+void select_nth(const TYPE_VALUE *results, int *rank, int from, int to, int k) {
+    int i, j, mid, p, t;
+#define SELECT_SWAP(a, b) { t = rank[a]; rank[a] = rank[b]; rank[b] = t; }
+    while(to - from > 1) {
+        // Median of three as the pivot, moved to the end
+        mid = from + (to - from) / 2;
+        if(select_below(results, rank[mid], rank[from])) SELECT_SWAP(mid, from)
+        if(select_below(results, rank[to-1], rank[from])) SELECT_SWAP(to-1, from)
+        if(select_below(results, rank[to-1], rank[mid])) SELECT_SWAP(to-1, mid)
+        SELECT_SWAP(mid, to-1)
+        p = rank[to-1];
+        j = from;
+        for(i=from; i<to-1; i++) {
+            if(select_below(results, rank[i], p)) { SELECT_SWAP(i, j) j++; }
+        }
+        SELECT_SWAP(j, to-1)
+        if(k == j) { break; }
+        if(k < j) { to = j; } else { from = j + 1; }
+    }
+#undef SELECT_SWAP
+}
+
+
+// Rank the brains by their results without sorting them fully
+// rank[0..POOL_SIZE-POOL_KEEP-1] are the brains to be replaced, rank[POOL_KEEP+2..POOL_SIZE-1] the top ones
+// to be cloned, and rank[POOL_SIZE-1] is the best brain
+void select_rank(const TYPE_VALUE *results, int *rank) {
+    int i;
+    for(i=0; i<POOL_SIZE; i++) { rank[i] = i; }
+    select_nth(results, rank, 0, POOL_SIZE, POOL_SIZE - POOL_KEEP);
+    select_nth(results, rank, POOL_SIZE - POOL_KEEP, POOL_SIZE, POOL_KEEP + 2);
+    select_nth(results, rank, POOL_KEEP + 2, POOL_SIZE, POOL_SIZE - 1);
+}
+
+
+// Breeding shared by the threads
+struct breed_job_t {
+    struct genes_t *genepool;
+    struct brain_t *brainpool;
+    const struct checkpoint_t *checkpoint; // to load the pool from (see pool_init)
+    int generation; // for the random streams
+    int pair_num;
+    int pairs[POOL_SIZE][2]; // source, target
+    int commands[POOL_SIZE]; // number of commands processed to build each offspring (stats)
+    int64_t build_ns; // time spent building the brains, summed over the threads (see METRICS)
+    int next_pair; // next pair (or genes for pool_init) for the threads to take
+};
+
+
+// Thread body for breed
+// Offspring only read their sources, which are not replaced, so they can be made at the same time
+void breed_worker(void *arg, int thread_ix) {
+    struct breed_job_t *job = arg;
+    struct rng_t rng;
+    struct genes_edit_t edit;
+    int first, k, source_ix, target_ix, mutations, mutations_i;
+    double start;
+    while(1) {
+        first = threads_take(&job->next_pair, BREED_CHUNK);
+        if(first >= job->pair_num) { break; }
+        for(k=first; k<first+BREED_CHUNK && k<job->pair_num; k++) {
+            source_ix = job->pairs[k][0];
+            target_ix = job->pairs[k][1];
+            // printf("Copying %d (res %f) to %d (res %f)\n", source_ix, results[source_ix], target_ix, results[target_ix]);
+            // Clone with the mutations applied in one go
+            genes_edit_begin(&edit, &job->genepool[source_ix], &job->genepool[target_ix]);
+            rng_init(&rng, RNG_BREED, job->generation, target_ix);
+            mutations = getrand(&rng) * 5;
+            for(mutations_i=0; mutations_i<=mutations; mutations_i++) {
+                genes_mutate_edit(&edit, &rng);
+            }
+            genes_edit_apply(&edit);
+            // Regenerate brain
+            start = metrics_now();
+            job->commands[k] = genes_rebuild_brain(&job->genepool[target_ix], &job->brainpool[target_ix], &job->brainpool[source_ix], &rng);
+            __atomic_fetch_add(&job->build_ns, (int64_t)((metrics_now() - start) * 1e9), __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+// Replace each target with a mutated clone of its source: pairs[k] = {source, target}
+// Returns the number of commands processed to build the new brains
+int breed(struct genes_t *genepool, struct brain_t *brainpool, int (*pairs)[2], int pair_num, int generation) {
+    int k, commands = 0;
+    struct breed_job_t *job = malloc(sizeof(struct breed_job_t));
+    if(job == NULL) { die("Out of memory"); }
+    
+    job->genepool = genepool;
+    job->brainpool = brainpool;
+    job->generation = generation;
+    job->pair_num = pair_num;
+    memcpy(job->pairs, pairs, pair_num * sizeof(pairs[0]));
+    job->build_ns = 0;
+    job->next_pair = 0;
+    threads_run(breed_worker, job);
+    
+    for(k=0; k<pair_num; k++) { commands += job->commands[k]; }
+    metrics.phase[METRICS_CREATE_BRAIN] += job->build_ns * 1e-9;
+    free(job);
+    return commands;
+}
+
+
+// Thread body for pool_init
+void pool_init_worker(void *arg, int thread_ix) {
+    struct breed_job_t *job = arg;
+    struct rng_t rng;
+    int first, i;
+    while(1) {
+        first = threads_take(&job->next_pair, BREED_CHUNK);
+        if(first >= POOL_SIZE) { break; }
+        for(i=first; i<first+BREED_CHUNK && i<POOL_SIZE; i++) {
+            rng_init(&rng, RNG_INIT, 0, i);
+            if(job->checkpoint != NULL) {
+                checkpoint_genes(job->checkpoint, i, &job->genepool[i]);
+            }
+            else {
+                genes_init(&job->genepool[i]);
+                genes_mutate(&job->genepool[i], &rng);
+            }
+            genes_create_brain(&job->genepool[i], &job->brainpool[i], &rng);
+        }
+    }
+}
+
+
+// Create the genes and brains of the pool, from the checkpoint if given, or new ones
+void pool_init(struct genes_t *genepool, struct brain_t *brainpool, const struct checkpoint_t *checkpoint) {
+    struct breed_job_t *job = malloc(sizeof(struct breed_job_t));
+    if(job == NULL) { die("Out of memory"); }
+    job->genepool = genepool;
+    job->brainpool = brainpool;
+    job->checkpoint = checkpoint;
+    job->next_pair = 0;
+    threads_run(pool_init_worker, job);
+    free(job);
+}
+
+
+// Replace the genes in the slots with migrants (from other pools or islands), and build their brains
+// The migrants are cleared
+void pool_inject(struct genes_t *genepool, struct brain_t *brainpool, struct genes_t *migrants, int migrant_num, const int *slots, int generation) {
+    struct rng_t rng;
+    int k;
+    double start;
+    for(k=0; k<migrant_num; k++) {
+        genes_clone(&migrants[k], &genepool[slots[k]]);
+        genes_clear(&migrants[k]);
+        rng_init(&rng, RNG_BREED, generation, slots[k]);
+        start = metrics_now();
+        genes_create_brain(&genepool[slots[k]], &brainpool[slots[k]], &rng);
+        metrics_add(METRICS_CREATE_BRAIN, start);
+        race.offspring[slots[k]] = 1;
+        checkpoint_mark(slots[k]);
+    }
+    fprintf(stderr, "Injected %d migrants\n", migrant_num);
+}
+
+
+// ==== XPOL ====================================================================================================================
+// Cross-pool communication: pools send their best genes to each other, and the genes received replace
+// the worst brains as migrants. The sockets are served by a background I/O thread, which passes the messages
+// to and from the main thread in two lock-free queues, so evolution never waits for the network.
+// A pool can listen for other pools (--xpol-listen) and connect to one (--xpol-connect), over a Unix-domain
+// (unix:PATH) or a TCP (HOST:PORT) socket. Messages are not passed on to other peers; client.php connects
+// a pool to server.php this way.
+// A message is a header, then the genes in the binary format of the checkpoints (entries, then commands)
+/*
+
+     main thread                 I/O thread                  other pool
+
+     xpol_send()
+     packs the best genes
+                ----outbox---->
+                                  ------message------->
+                                  <-----message--------
+                                  checks the message
+                <----inbox-----
+     xpol_receive()
+     checks the genes
+     xpol_inject()
+     replaces the worst brains
+
+*/
+
+#define XPOL_INTERVAL 5 // generations between sending genes
+#define XPOL_BATCH 4 // how many of the best genes to send
+#define XPOL_INJECT 4 // at most this many migrants (from other pools and islands) are injected in a generation (the others wait)
+#define XPOL_QUEUE 64 // messages in the inbox and the outbox (messages that do not fit are dropped)
+#define XPOL_MAX_PEERS 16
+#define XPOL_MAX_MESSAGE (64 << 20) // bytes in a message, and waiting to be sent to a peer
+#define XPOL_RECONNECT 1 // seconds between attempts to connect
+#define XPOL_MAGIC 0x4C4F5058
+_Static_assert(POOL_SIZE - POOL_KEEP >= XPOL_INJECT + 2, "Not enough brains are replaced for the migrants");
+
+struct xpol_header_t {
+    uint32_t magic;
+    uint32_t genes_num;
+    uint64_t command_num;
+    int32_t pool_id; // of the sender
+    uint32_t generation; // of the sender
+    uint64_t checksum; // of the entries and commands (see checkpoint_checksum)
+};
+
+// Queue with one thread pushing and one thread popping
+struct xpol_queue_t {
+    void *items[XPOL_QUEUE];
+    unsigned head; // next item to pop
+    unsigned tail; // next place to push to
+};
+
+struct xpol_peer_t {
+    int fd; // -1 if the slot is free
+    int outgoing; // made by --xpol-connect
+    char *in; // bytes received but not processed
+    size_t in_len, in_capacity;
+    char *out; // bytes to send from out_pos
+    size_t out_pos, out_len, out_capacity;
+};
+
+struct xpol_t {
+    int on;
+    int pool_id; // sent with the messages so that the pool ignores its own ones coming back
+    pthread_t thread;
+    int wake[2]; // pipe to wake up the I/O thread
+    int listen_fd;
+    const char *connect_name;
+    struct sockaddr_storage connect_address;
+    socklen_t connect_address_len;
+    time_t connect_time; // last attempt
+    int connect_failed;
+    struct xpol_peer_t peers[XPOL_MAX_PEERS]; // used by the I/O thread only
+    struct xpol_queue_t inbox;
+    struct xpol_queue_t outbox;
+    struct xpol_header_t *message; // the message the migrants are taken from (main thread only)
+    int message_pos;
+};
+struct xpol_t xpol = { .on = 0 };
+
+
+// Returns success
+int xpol_queue_push(struct xpol_queue_t *queue, void *item) {
+    unsigned tail = queue->tail;
+    if(tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == XPOL_QUEUE) { return 0; }
+    queue->items[tail % XPOL_QUEUE] = item;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+
+// Returns NULL if the queue is empty
+void *xpol_queue_pop(struct xpol_queue_t *queue) {
+    unsigned head = queue->head;
+    void *item;
+    if(head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) { return NULL; }
+    item = queue->items[head % XPOL_QUEUE];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+
+// The size of a message in bytes
+size_t xpol_message_size(const struct xpol_header_t *header) {
+    return sizeof(struct xpol_header_t) + header->genes_num * sizeof(struct checkpoint_entry_t) + header->command_num * sizeof(struct genes_command_t);
+}
+
+
+// Parse an address: unix:PATH or HOST:PORT (HOST can be empty to listen on all interfaces)
+// Returns success
+int xpol_address(const char *name, struct sockaddr_storage *address, socklen_t *address_len) {
+    struct addrinfo hints, *result;
+    const char *colon;
+    char host[256];
+    
+    memset(address, 0, sizeof(*address));
+    if(strncmp(name, "unix:", 5) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un *)address;
+        if(name[5] == 0 || strlen(name + 5) >= sizeof(un->sun_path)) { return 0; }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, name + 5);
+        *address_len = sizeof(struct sockaddr_un);
+        return 1;
+    }
+    colon = strrchr(name, ':');
+    if(colon == NULL || colon - name >= (int)sizeof(host)) { return 0; }
+    memcpy(host, name, colon - name);
+    host[colon - name] = 0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if(getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &result) != 0) { return 0; }
+    memcpy(address, result->ai_addr, result->ai_addrlen);
+    *address_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 1;
+}
+
+
+// Append bytes to a buffer
+void xpol_buffer_add(char **buf, size_t *len, size_t *capacity, const void *data, size_t size) {
+    if(*len + size > *capacity) {
+        *capacity = (*len + size > *capacity * 2 ? *len + size : *capacity * 2);
+        *buf = realloc(*buf, *capacity);
+        if(*buf == NULL) { die("Out of memory"); }
+    }
+    memcpy(*buf + *len, data, size);
+    *len += size;
+}
+
+
+void xpol_peer_add(int fd, int outgoing) {
+    int p;
+    for(p=0; p<XPOL_MAX_PEERS; p++) {
+        if(xpol.peers[p].fd == -1) { break; }
+    }
+    if(p == XPOL_MAX_PEERS) {
+        fprintf(stderr, "XPOL: too many peers, connection refused\n");
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    xpol.peers[p].fd = fd;
+    xpol.peers[p].outgoing = outgoing;
+    xpol.peers[p].in_len = 0;
+    xpol.peers[p].out_pos = 0;
+    xpol.peers[p].out_len = 0;
+}
+
+
+void xpol_peer_close(struct xpol_peer_t *peer) {
+    fprintf(stderr, (peer->outgoing ? "XPOL: connection to %s lost\n" : "XPOL: peer disconnected%s\n"), (peer->outgoing ? xpol.connect_name : ""));
+    close(peer->fd);
+    peer->fd = -1;
+}
+
+
+// Connect to the pool given by --xpol-connect
+void xpol_connect(void) {
+    int fd = socket(xpol.connect_address.ss_family, SOCK_STREAM, 0);
+    xpol.connect_time = time(NULL);
+    if(fd < 0 || connect(fd, (struct sockaddr *)&xpol.connect_address, xpol.connect_address_len) != 0) {
+        if(fd >= 0) { close(fd); }
+        if(!xpol.connect_failed) { fprintf(stderr, "XPOL: cannot connect to %s, retrying\n", xpol.connect_name); }
+        xpol.connect_failed = 1;
+        return;
+    }
+    fprintf(stderr, "XPOL: connected to %s\n", xpol.connect_name);
+    xpol.connect_failed = 0;
+    xpol_peer_add(fd, 1);
+}
+
+
+// Send what can be sent to a peer without waiting
+// Returns 0 if the connection is broken
+int xpol_peer_write(struct xpol_peer_t *peer) {
+    ssize_t sent;
+    while(peer->out_pos < peer->out_len) {
+        sent = send(peer->fd, peer->out + peer->out_pos, peer->out_len - peer->out_pos, MSG_NOSIGNAL);
+        if(sent > 0) { peer->out_pos += sent; }
+        else if(sent < 0 && errno == EINTR) { continue; }
+        else if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { return 1; }
+        else { return 0; }
+    }
+    peer->out_pos = peer->out_len = 0;
+    return 1;
+}
+
+
+// Queue a message to be sent to all peers
+void xpol_broadcast(const struct xpol_header_t *message) {
+    size_t size = xpol_message_size(message);
+    struct xpol_peer_t *peer;
+    for(int p=0; p<XPOL_MAX_PEERS; p++) {
+        peer = &xpol.peers[p];
+        if(peer->fd == -1) { continue; }
+        if(peer->out_len - peer->out_pos + size > XPOL_MAX_MESSAGE) {
+            fprintf(stderr, "XPOL: peer too slow, message dropped\n");
+            continue;
+        }
+        if(peer->out_pos > 0) {
+            memmove(peer->out, peer->out + peer->out_pos, peer->out_len - peer->out_pos);
+            peer->out_len -= peer->out_pos;
+            peer->out_pos = 0;
+        }
+        xpol_buffer_add(&peer->out, &peer->out_len, &peer->out_capacity, message, size);
+    }
+}
+
+
+// Take the complete messages from the bytes received from a peer and put them into the inbox
+// Returns 0 if the peer sent something that is not a message
+int xpol_peer_parse(struct xpol_peer_t *peer) {
+    const struct xpol_header_t *header;
+    struct xpol_header_t *message;
+    size_t pos = 0, size;
+    
+    while(peer->in_len - pos >= sizeof(struct xpol_header_t)) {
+        header = (const struct xpol_header_t *)(peer->in + pos);
+        if(header->magic != XPOL_MAGIC || header->genes_num > POOL_SIZE || header->command_num > XPOL_MAX_MESSAGE / sizeof(struct genes_command_t)) { return 0; }
+        size = xpol_message_size(header);
+        if(size > XPOL_MAX_MESSAGE) { return 0; }
+        if(peer->in_len - pos < size) { break; }
+        if(header->checksum != checkpoint_checksum(header + 1, size - sizeof(struct xpol_header_t))) { return 0; }
+        if(header->pool_id != xpol.pool_id) {
+            message = malloc(size);
+            if(message == NULL) { die("Out of memory"); }
+            memcpy(message, header, size);
+            if(!xpol_queue_push(&xpol.inbox, message)) {
+                fprintf(stderr, "XPOL: inbox full, message dropped\n");
+                free(message);
+            }
+        }
+        pos += size;
+    }
+    memmove(peer->in, peer->in + pos, peer->in_len - pos);
+    peer->in_len -= pos;
+    return 1;
+}
+
+
+// Receive what can be received from a peer without waiting
+// Returns 0 if the connection is closed or broken
+int xpol_peer_read(struct xpol_peer_t *peer) {
+    ssize_t got;
+    while(1) {
+        if(peer->in_capacity - peer->in_len < 65536) {
+            peer->in_capacity = peer->in_len + (peer->in_len > 65536 ? peer->in_len : 65536);
+            peer->in = realloc(peer->in, peer->in_capacity);
+            if(peer->in == NULL) { die("Out of memory"); }
+        }
+        got = recv(peer->fd, peer->in + peer->in_len, peer->in_capacity - peer->in_len, 0);
+        if(got == 0) { return 0; }
+        if(got < 0) {
+            if(errno == EINTR) { continue; }
+            return (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+        peer->in_len += got;
+        if(!xpol_peer_parse(peer)) {
+            fprintf(stderr, "XPOL: invalid message from peer\n");
+            return 0;
+        }
+    }
+}
+
+
+// The I/O thread
+void *xpol_main(void *arg) {
+    struct pollfd fds[XPOL_MAX_PEERS + 2];
+    int fd_peer[XPOL_MAX_PEERS + 2];
+    int fd_num, k, p, connected;
+    char buf[64];
+    struct xpol_header_t *message;
+    
+    while(1) {
+        connected = 0;
+        for(p=0; p<XPOL_MAX_PEERS; p++) {
+            if(xpol.peers[p].fd != -1 && xpol.peers[p].outgoing) { connected = 1; }
+        }
+        if(xpol.connect_name != NULL && !connected && time(NULL) - xpol.connect_time >= XPOL_RECONNECT) { xpol_connect(); }
+        
+        fd_num = 0;
+        fds[fd_num].fd = xpol.wake[0];
+        fds[fd_num].events = POLLIN;
+        fd_peer[fd_num++] = -1;
+        if(xpol.listen_fd != -1) {
+            fds[fd_num].fd = xpol.listen_fd;
+            fds[fd_num].events = POLLIN;
+            fd_peer[fd_num++] = -1;
+        }
+        for(p=0; p<XPOL_MAX_PEERS; p++) {
+            if(xpol.peers[p].fd == -1) { continue; }
+            fds[fd_num].fd = xpol.peers[p].fd;
+            fds[fd_num].events = POLLIN | (xpol.peers[p].out_pos < xpol.peers[p].out_len ? POLLOUT : 0);
+            fd_peer[fd_num++] = p;
+        }
+        if(poll(fds, fd_num, XPOL_RECONNECT * 1000) < 0) {
+            if(errno == EINTR) { continue; }
+            die("XPOL: poll failed");
+        }
+        
+        if(fds[0].revents & POLLIN) {
+            while(read(xpol.wake[0], buf, sizeof(buf)) > 0) { }
+        }
+        while((message = xpol_queue_pop(&xpol.outbox)) != NULL) {
+            xpol_broadcast(message);
+            free(message);
+        }
+        for(k=0; k<fd_num; k++) {
+            if(fd_peer[k] == -1 && fds[k].fd == xpol.listen_fd && (fds[k].revents & POLLIN)) {
+                int fd = accept(xpol.listen_fd, NULL, NULL);
+                if(fd >= 0) {
+                    fprintf(stderr, "XPOL: peer connected\n");
+                    xpol_peer_add(fd, 0);
+                }
+            }
+            if(fd_peer[k] == -1) { continue; }
+            struct xpol_peer_t *peer = &xpol.peers[fd_peer[k]];
+            if((fds[k].revents & (POLLIN | POLLHUP | POLLERR)) && !xpol_peer_read(peer)) {
+                xpol_peer_close(peer);
+            }
+        }
+        for(p=0; p<XPOL_MAX_PEERS; p++) {
+            if(xpol.peers[p].fd != -1 && !xpol_peer_write(&xpol.peers[p])) { xpol_peer_close(&xpol.peers[p]); }
+        }
+    }
+    return NULL;
+}
+
+
+// Start cross-pool communication
+// listen_name and connect_name are addresses (see xpol_address) or NULL
+void xpol_start(int pool_id, const char *listen_name, const char *connect_name) {
+    struct sockaddr_storage address;
+    socklen_t address_len;
+    int p, yes = 1;
+    
+    xpol.on = 1;
+    xpol.pool_id = pool_id;
+    xpol.listen_fd = -1;
+    xpol.connect_name = connect_name;
+    xpol.connect_time = 0;
+    xpol.connect_failed = 0;
+    for(p=0; p<XPOL_MAX_PEERS; p++) {
+        xpol.peers[p].fd = -1;
+        xpol.peers[p].in = xpol.peers[p].out = NULL;
+        xpol.peers[p].in_capacity = xpol.peers[p].out_capacity = 0;
+    }
+    xpol.inbox.head = xpol.inbox.tail = 0;
+    xpol.outbox.head = xpol.outbox.tail = 0;
+    xpol.message = NULL;
+    
+    if(listen_name != NULL) {
+        if(!xpol_address(listen_name, &address, &address_len)) { die("Wrong usage - wrong xpol address"); }
+        xpol.listen_fd = socket(address.ss_family, SOCK_STREAM, 0);
+        if(xpol.listen_fd < 0) { die("Cannot create socket"); }
+        if(address.ss_family == AF_UNIX) { unlink(((struct sockaddr_un *)&address)->sun_path); }
+        else { setsockopt(xpol.listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)); }
+        if(bind(xpol.listen_fd, (struct sockaddr *)&address, address_len) != 0 || listen(xpol.listen_fd, XPOL_MAX_PEERS) != 0) { die("Cannot listen on the xpol address"); }
+        fcntl(xpol.listen_fd, F_SETFL, fcntl(xpol.listen_fd, F_GETFL) | O_NONBLOCK);
+        fprintf(stderr, "XPOL: listening on %s\n", listen_name);
+    }
+    if(connect_name != NULL) {
+        if(!xpol_address(connect_name, &xpol.connect_address, &xpol.connect_address_len)) { die("Wrong usage - wrong xpol address"); }
+    }
+    
+    if(pipe(xpol.wake) != 0) { die("Cannot create pipe"); }
+    fcntl(xpol.wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(xpol.wake[1], F_SETFL, O_NONBLOCK);
+    if(pthread_create(&xpol.thread, NULL, xpol_main, NULL) != 0) { die("Cannot start the xpol thread"); }
+}
+
+
+// Send the genes in the given slots to the other pools
+void xpol_send(const struct genes_t *genepool, const int *slots, int slot_num, int generation) {
+    uint64_t command_num = 0, pos = 0;
+    size_t size;
+    int k;
+    struct xpol_header_t *message;
+    struct checkpoint_entry_t *entries;
+    struct genes_command_t *commands;
+    
+    if(!xpol.on) { return; }
+    for(k=0; k<slot_num; k++) { command_num += genepool[slots[k]].length; }
+    size = sizeof(struct xpol_header_t) + slot_num * sizeof(struct checkpoint_entry_t) + command_num * sizeof(struct genes_command_t);
+    if(size > XPOL_MAX_MESSAGE) {
+        fprintf(stderr, "XPOL: genes too long to send\n");
+        return;
+    }
+    message = calloc(1, size);
+    if(message == NULL) { die("Out of memory"); }
+    entries = (struct checkpoint_entry_t *)(message + 1);
+    commands = (struct genes_command_t *)(entries + slot_num);
+    
+    message->magic = XPOL_MAGIC;
+    message->genes_num = slot_num;
+    message->command_num = command_num;
+    message->pool_id = xpol.pool_id;
+    message->generation = generation;
+    for(k=0; k<slot_num; k++) { pos += checkpoint_pack(&genepool[slots[k]], slots[k], pos, &entries[k], commands); }
+    message->checksum = checkpoint_checksum(message + 1, size - sizeof(struct xpol_header_t));
+    
+    if(!xpol_queue_push(&xpol.outbox, message)) {
+        fprintf(stderr, "XPOL: outbox full, genes not sent\n");
+        free(message);
+        return;
     }
+    if(write(xpol.wake[1], "", 1) < 0) { } // the I/O thread is already being woken up
+    fprintf(stderr, "XPOL: sending %d genes\n", slot_num);
 }
 
 
-// Test the task code by printing sample surfaces
-void task_test(void) {
-    struct task_t *task = task_alloc();
-    task_init(task);
-    task_plot(task, 0,0,0,0,0,0);
+// Check that genes from another pool can be built into a brain
+// Returns success
+int xpol_check_genes(const struct checkpoint_entry_t *entry, const struct genes_command_t *commands, uint64_t command_num) {
+    int weights = 0, sumsis = 0;
+    if(entry->length < 1 || entry->length > command_num || entry->first > command_num - entry->length) { return 0; }
+    if(!isfinite(entry->learning_rate) || !(entry->thinking_time >= MIN_THINKING_TIME && entry->thinking_time <= 100 * INITIAL_THINKING_TIME)) { return 0; }
+    commands += entry->first;
+    for(uint32_t i=0; i<entry->length; i++) {
+        switch(commands[i].command) {
+            case CMD_NEW_WEIGHT: weights++; break;
+            case CMD_NEW_SUMSI: sumsis++; break;
+            case CMD_SUMSI_TO_WEIGHT_IN:
+            case CMD_SUMSI_TO_WEIGHT_CTRL:
+            case CMD_WEIGHT_TO_SUMSI_IN:
+            case CMD_WEIGHT_TO_WEIGHT_CTRL:
+                if(commands[i].arg < 0 && commands[i].arg != ARG_RAND_WEIGHT && commands[i].arg != ARG_RAND_SUMSI) { return 0; }
+                break;
+            case CMD_WEIGHT_TO_INPUT:
+                if(commands[i].arg < 0 || commands[i].arg >= NUM_INPUTS) { return 0; }
+                break;
+            case CMD_POP_WEIGHT:
+            case CMD_POP_SUMSI:
+            case CMD_SUMSI_TO_OUT:
+                break;
+            default:
+                return 0;
+        }
+    }
+    // See brain_constr_init and brain_constr_process_command
+    return (weights <= MAX_WEIGHTS - 3 && sumsis <= MAX_SUMSIS - 3);
 }
 
 
-// Get a random coordinate value in (-1..1)
-TYPE_VALUE task_get_coord(void) {
-    return getrand() * 2. - 1.;
-}
-
-
-// Get a training question from a task
-// This returns (in arguments) the coordinates of a positive point, the coordinates of a negative point, a question point and a target answer
-// Can return whether a baseline strategy can guess the correct answer
-int task_get_question(
-    struct task_t *task,
-    TYPE_VALUE *pos_x, 
-    TYPE_VALUE *pos_y,
-    TYPE_VALUE *neg_x,
-    TYPE_VALUE *neg_y,
-    TYPE_VALUE *question_x,
-    TYPE_VALUE *question_y,
-    int *target
-) {
-    TYPE_VALUE x, y;
-    int no_pos = 1, no_neg = 1;
-    while(no_pos || no_neg) {
-        x = task_get_coord();
-        y = task_get_coord();
-        if(task_get_value(task, x, y) < 0) {
-            no_neg = 0;
-            *neg_x = x;
-            *neg_y = y;
+// Add the genes received from other pools to the migrants, up to XPOL_INJECT (the others wait in the inbox)
+// Returns the number of migrants
+int xpol_receive(struct genes_t *migrants, int migrant_num) {
+    const struct checkpoint_entry_t *entries;
+    const struct genes_command_t *commands;
+    
+    if(!xpol.on) { return migrant_num; }
+    while(migrant_num < XPOL_INJECT) {
+        if(xpol.message == NULL) {
+            xpol.message = xpol_queue_pop(&xpol.inbox);
+            if(xpol.message == NULL) { break; }
+            xpol.message_pos = 0;
+        }
+        if(xpol.message_pos == (int)xpol.message->genes_num) {
+            free(xpol.message);
+            xpol.message = NULL;
+            continue;
+        }
+        entries = (const struct checkpoint_entry_t *)(xpol.message + 1);
+        commands = (const struct genes_command_t *)(entries + xpol.message->genes_num);
+        if(xpol_check_genes(&entries[xpol.message_pos], commands, xpol.message->command_num)) {
+            checkpoint_entry_genes(&entries[xpol.message_pos], commands + entries[xpol.message_pos].first, &migrants[migrant_num++]);
         }
         else {
-            no_pos = 0;
-            *pos_x = x;
-            *pos_y = y;
+            fprintf(stderr, "XPOL: invalid genes from pool %d dropped\n", xpol.message->pool_id);
         }
+        xpol.message_pos++;
     }
-    x = task_get_coord();
-    y = task_get_coord();
-    *question_x = x;
-    *question_y = y;
-    *target = (task_get_value(task, x, y) >= 0);
-    
-    // Use a baseline strategy to try to answer our own question
-    // The strategy is to respond with the class of the closes example seen so far
-    // TODO This does not take into account that the brains are aware of their own scores
-    // so can use the questions as well to learn the surface better. Can add this later.
-#if CALCULATE_BASELINE
-    task->examples_pos_x[task->step] = *pos_x;
-    task->examples_pos_y[task->step] = *pos_y;
-    task->examples_neg_x[task->step] = *neg_x;
-    task->examples_neg_y[task->step] = *neg_y;
-    int baseline_answer = -1;
-    TYPE_VALUE d2, min_distance2 = 10.; // coordinates between -1 and 1
-    for(int i=0; i<task->step; i++) {
-        d2 = (task->examples_pos_x[i] - x) * (task->examples_pos_x[i] - x) + (task->examples_pos_y[i] - y) * (task->examples_pos_y[i] - y);
-        if(d2 < min_distance2) { baseline_answer = 1; min_distance2 = d2; }
-        d2 = (task->examples_neg_x[i] - x) * (task->examples_neg_x[i] - x) + (task->examples_neg_y[i] - y) * (task->examples_neg_y[i] - y);
-        if(d2 < min_distance2) { baseline_answer = 0; min_distance2 = d2; }
-    }
-    task->step++;
-    if(task->step > STEPS) { die("Too many steps for a task"); }
-    return (*target == baseline_answer);
-#else
-    return -1;
-#endif
+    return migrant_num;
 }
 
 
-// ==== EVALUATE ===================================================================================================================
+// ==== DISTRIBUTE ===============================================================================================================
+// The evaluation can be shared out to worker processes on this or other machines (--coordinator ADDRESS, --worker ADDRESS).
+// The coordinator keeps the gene pool, and does the selection and the breeding. In each generation it sends jobs
+// to the workers, each with the genes of some brains, in the binary format of the checkpoints. The workers build
+// the brains, make the tasks of the generation from the seed, and send back the number of correct answers of the brains.
+// As the random streams only depend on the seed, the generation and the brain, the results are the same as when the
+// brains are evaluated locally (with the same kernels, see brain_select_kernels).
+// Workers can come and go. The jobs of a worker that disconnects are sent to others. When there is no new job for
+// a worker, it gets one that another worker is still doing, so a slow worker does not hold up the generation.
+// The first results of a job to arrive are used. Racing and islands are not supported with workers
+/*
 
-// Evaluate brains against a task. They need to learn and respond
-// Return the energy of the brain (related to correct answers)
-int evaluate(struct brain_t *brainpool, struct task_t *task, TYPE_VALUE *results, int best_brain) {
-    int target, answer, think, i, question_num;
-    TYPE_VALUE thinking_time_v;
-    TYPE_VALUE input_state[NUM_INPUTS];
-    int target_1_num = 0, best_brain_1_num = 0, best_brain_correct_num = 0; // stats
-    int baseline_correct = 0;
-    
-    input_state[8] = 1.; // bias
-    
-    for(i=0; i<POOL_SIZE; i++) {
-        brain_play_init(&brainpool[i]);
-        // results[i] = 0; -- initialised elsewhere
+     coordinator                           worker
+
+     distribute_evaluate()
+     packs the genes into jobs
+                    --------job-------->
+                                           distribute_worker()
+                                           builds the brains
+                                           makes the tasks
+                                           evaluates the brains
+                    <------results------
+     collects the results
+
+*/
+
+#define DISTRIBUTE_CHUNK 32 // brains in a job
+#define DISTRIBUTE_PIPELINE 2 // jobs sent to a worker at a time
+#define DISTRIBUTE_COPIES 2 // a job is sent to at most this many workers at the same time, unless it is late
+#define DISTRIBUTE_TIMEOUT 60 // seconds after which a job is late
+#define DISTRIBUTE_MAX_WORKERS 256
+#define DISTRIBUTE_JOB_MAGIC 0x424F4A44
+#define DISTRIBUTE_RESULT_MAGIC 0x53455244
+
+struct distribute_job_header_t {
+    uint32_t magic;
+    uint32_t job_id;
+    uint64_t seed;
+    int32_t generation;
+    int32_t best_brain; // if it is in the job, otherwise -1
+    uint32_t genes_num;
+    uint32_t reserved;
+    uint64_t command_num;
+    uint64_t checksum; // of the entries and commands (see checkpoint_checksum)
+};
+
+struct distribute_result_header_t {
+    uint32_t magic;
+    uint32_t job_id;
+    uint32_t genes_num;
+    uint32_t reserved;
+    // stats for each task (see evaluate_log)
+    int32_t target_1_num[TASK_NUM];
+    int32_t baseline_correct[TASK_NUM];
+    int32_t best_brain_1_num[TASK_NUM];
+    int32_t best_brain_correct_num[TASK_NUM];
+};
+// followed by int32_t correct[genes_num], the number of correct answers of each brain of the job in all the tasks
+
+// A job of a generation (on the coordinator)
+struct distribute_job_t {
+    struct distribute_job_header_t *message;
+    size_t size;
+    int copies; // the number of workers doing it
+    time_t sent; // when it was last sent to a worker
+    int done;
+};
+
+struct distribute_worker_t {
+    struct xpol_peer_t conn;
+    uint32_t jobs[DISTRIBUTE_PIPELINE]; // the ids of the jobs sent and not answered
+    int job_num;
+};
+
+struct distribute_t {
+    int on;
+    int listen_fd;
+    uint32_t next_job_id;
+    struct distribute_worker_t workers[DISTRIBUTE_MAX_WORKERS];
+};
+struct distribute_t distribute = { .on = 0 };
+
+
+// Listen for workers
+void distribute_start(const char *address_name) {
+    struct sockaddr_storage address;
+    socklen_t address_len;
+    int yes = 1;
+    if(!xpol_address(address_name, &address, &address_len)) { die("Wrong usage - wrong coordinator address"); }
+    distribute.listen_fd = socket(address.ss_family, SOCK_STREAM, 0);
+    if(distribute.listen_fd < 0) { die("Cannot create socket"); }
+    if(address.ss_family == AF_UNIX) { unlink(((struct sockaddr_un *)&address)->sun_path); }
+    else { setsockopt(distribute.listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)); }
+    if(bind(distribute.listen_fd, (struct sockaddr *)&address, address_len) != 0 || listen(distribute.listen_fd, DISTRIBUTE_MAX_WORKERS) != 0) { die("Cannot listen on the coordinator address"); }
+    fcntl(distribute.listen_fd, F_SETFL, fcntl(distribute.listen_fd, F_GETFL) | O_NONBLOCK);
+    for(int w=0; w<DISTRIBUTE_MAX_WORKERS; w++) {
+        distribute.workers[w].conn.fd = -1;
+        distribute.workers[w].conn.in = distribute.workers[w].conn.out = NULL;
+        distribute.workers[w].conn.in_capacity = distribute.workers[w].conn.out_capacity = 0;
     }
-    
-    for(question_num=0; question_num<STEPS; question_num++) { // Loop through questions
-        
-        baseline_correct += task_get_question(
-            task, 
-            &input_state[0], // pos_x
-            &input_state[1], 
-            &input_state[2], 
-            &input_state[3], 
-            &input_state[4], 
-            &input_state[5], // question_y
-            &target
-        );
-        
-        if(target) { target_1_num++; } // stats
-        
-        for(i=0; i<POOL_SIZE; i++) { // Loop through brains
-            
-            input_state[6] = 0; // results[i]; (Values are too big)
-            // Debug: task_plot(task, brain->input_state[0], brain->input_state[1], brain->input_state[2], brain->input_state[3], brain->input_state[4], brain->input_state[5]);
-        
-            thinking_time_v = brainpool[i].thinking_time;
-            for(think = 0; think < thinking_time_v; think++) { // Loop thinking
-                input_state[7] = ((TYPE_VALUE)think) / thinking_time_v; // clock
-                brain_play_step(&brainpool[i], input_state);
-            }
-        
-            answer = (brain_get_output(&brainpool[i]) >= 0);
-            if(answer == target) { results[i]++; }
-            // if(i == best_brain) { printf("Best brain: %d Question: %d Answer: %d Target: %d Result: %f\n", i, question_num, answer, target, results[i]); }
-            if(i == best_brain) { 
-                if(answer) { best_brain_1_num++; }
-                if(answer == target) { best_brain_correct_num++; }
-            }
-            
-        } // end loop through brains
-    } // end loop through questions
-    
-    fprintf(stderr, "Task: Prev best brain: %d Target=1ratio: %f Answer=1ratio: %f CorrectRatio: %f BaselineCorrectRatio: %f\n", best_brain, ((TYPE_VALUE)target_1_num) / STEPS, ((TYPE_VALUE)best_brain_1_num) / STEPS, ((TYPE_VALUE)best_brain_correct_num) / STEPS, ((TYPE_VALUE)baseline_correct) / STEPS);
+    distribute.next_job_id = 1;
+    distribute.on = 1;
+    fprintf(stderr, "Coordinator: listening on %s\n", address_name);
 }
 
 
-// ==== XPOL ====================================================================================================================
-// Download and upload genes via client.php and a file
-/*
+// Accept a worker
+void distribute_accept(void) {
+    int w, fd = accept(distribute.listen_fd, NULL, NULL);
+    if(fd < 0) { return; }
+    for(w=0; w<DISTRIBUTE_MAX_WORKERS && distribute.workers[w].conn.fd != -1; w++) { }
+    if(w == DISTRIBUTE_MAX_WORKERS) {
+        fprintf(stderr, "Coordinator: too many workers, connection refused\n");
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    distribute.workers[w].conn.fd = fd;
+    distribute.workers[w].conn.in_len = 0;
+    distribute.workers[w].conn.out_pos = 0;
+    distribute.workers[w].conn.out_len = 0;
+    distribute.workers[w].job_num = 0;
+    fprintf(stderr, "Coordinator: worker %d connected\n", w);
+}
 
-     rand-brain-evo.c       client.php          server.php
-
-Download
-     XPOL_NOOP
-     xpol_request_download()
-     XPOL_DOWNLOAD
-               ----USR1------->
-                                   ------POST----->
-                                   <-----data------
-                            writes file
-               <---USR1--------
-     XPOL_DOWNLOAD_READY
-     xpol_tick()
-     reads file
-     XPOL_NOOP
-     
-Upload
-     XPOL_NOOP
-     xpol_upload()
-     XPOL_UPLOAD
-     writes file
-               ----USR2------->
-                            reads file
-                                   ------POST----->
-                                   <-----"ok"------
-               <---USR2--------
-     XPOL_NOOP     
 
-*/
+// Disconnect a worker. Its jobs are given to others
+void distribute_close(int w, struct distribute_job_t *jobs, int job_num, uint32_t first_id) {
+    struct distribute_worker_t *worker = &distribute.workers[w];
+    for(int k=0; k<worker->job_num; k++) {
+        if(worker->jobs[k] - first_id < (uint32_t)job_num) { jobs[worker->jobs[k] - first_id].copies--; }
+    }
+    fprintf(stderr, "Coordinator: worker %d disconnected\n", w);
+    close(worker->conn.fd);
+    worker->conn.fd = -1;
+}
+
+
+// Choose the next job for a worker: one that has not been sent yet, or the oldest one that other workers are doing
+// if the worker has nothing else to do and the job does not have enough copies yet or is late
+// Returns the index of the job or -1
+int distribute_pick(const struct distribute_worker_t *worker, const struct distribute_job_t *jobs, int job_num, uint32_t first_id) {
+    int j, k, best = -1;
+    time_t now = time(NULL);
+    for(j=0; j<job_num; j++) {
+        if(!jobs[j].done && jobs[j].copies == 0) { return j; }
+    }
+    if(worker->job_num > 0) { return -1; }
+    for(j=0; j<job_num; j++) {
+        if(jobs[j].done || (jobs[j].copies >= DISTRIBUTE_COPIES && now - jobs[j].sent < DISTRIBUTE_TIMEOUT)) { continue; }
+        for(k=0; k<worker->job_num && worker->jobs[k] != first_id + j; k++) { }
+        if(k < worker->job_num) { continue; }
+        if(best == -1 || jobs[j].sent < jobs[best].sent) { best = j; }
+    }
+    return best;
+}
 
-void xpol_sig_handler(int signum) {
-    if(signum == SIGUSR1) {
-        if(xpol_state == XPOL_DOWNLOAD) {
-            fprintf(stderr, "XPOL: download ready\n");
-            xpol_state = XPOL_DOWNLOAD_READY;
+
+// Take the results from the bytes received from a worker
+// Returns 0 if the worker sent something that is not a result
+int distribute_parse(struct distribute_worker_t *worker, struct distribute_job_t *jobs, int job_num, uint32_t first_id,
+        TYPE_VALUE *results, int *stats, int *done_num) {
+    struct xpol_peer_t *conn = &worker->conn;
+    const struct distribute_result_header_t *header;
+    const struct checkpoint_entry_t *entries;
+    const int32_t *correct;
+    size_t pos = 0, size;
+    int j, k, t;
+    
+    while(conn->in_len - pos >= sizeof(struct distribute_result_header_t)) {
+        header = (const struct distribute_result_header_t *)(conn->in + pos);
+        if(header->magic != DISTRIBUTE_RESULT_MAGIC || header->genes_num > POOL_SIZE) { return 0; }
+        size = sizeof(struct distribute_result_header_t) + header->genes_num * sizeof(int32_t);
+        if(conn->in_len - pos < size) { break; }
+        for(k=0; k<worker->job_num && worker->jobs[k] != header->job_id; k++) { }
+        if(k == worker->job_num) { return 0; }
+        worker->jobs[k] = worker->jobs[--worker->job_num];
+        j = header->job_id - first_id;
+        if(header->job_id - first_id < (uint32_t)job_num) {
+            jobs[j].copies--;
+            if(header->genes_num != jobs[j].message->genes_num) { return 0; }
+            if(!jobs[j].done) {
+                // the first results to arrive are used
+                entries = (const struct checkpoint_entry_t *)(jobs[j].message + 1);
+                correct = (const int32_t *)(header + 1);
+                for(k=0; k<(int)header->genes_num; k++) { results[entries[k].slot] += correct[k]; }
+                for(t=0; t<TASK_NUM; t++) {
+                    stats[t * 4] = header->target_1_num[t];
+                    stats[t * 4 + 3] = header->baseline_correct[t];
+                    if(jobs[j].message->best_brain != -1) {
+                        stats[t * 4 + 1] = header->best_brain_1_num[t];
+                        stats[t * 4 + 2] = header->best_brain_correct_num[t];
+                    }
+                }
+                jobs[j].done = 1;
+                (*done_num)++;
+            }
         }
-        else {
-            die("Unexpected USR1 (download)");
+        pos += size;
+    }
+    memmove(conn->in, conn->in + pos, conn->in_len - pos);
+    conn->in_len -= pos;
+    return 1;
+}
+
+
+// Receive what can be received from a worker without waiting
+// Returns 0 if the connection is closed or broken
+int distribute_read(struct distribute_worker_t *worker, struct distribute_job_t *jobs, int job_num, uint32_t first_id,
+        TYPE_VALUE *results, int *stats, int *done_num) {
+    struct xpol_peer_t *conn = &worker->conn;
+    ssize_t got;
+    while(1) {
+        if(conn->in_capacity - conn->in_len < 65536) {
+            conn->in_capacity = conn->in_len + 65536;
+            conn->in = realloc(conn->in, conn->in_capacity);
+            if(conn->in == NULL) { die("Out of memory"); }
+        }
+        got = recv(conn->fd, conn->in + conn->in_len, conn->in_capacity - conn->in_len, 0);
+        if(got == 0) { return 0; }
+        if(got < 0) {
+            if(errno == EINTR) { continue; }
+            return (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+        conn->in_len += got;
+        if(!distribute_parse(worker, jobs, job_num, first_id, results, stats, done_num)) {
+            fprintf(stderr, "Coordinator: invalid results from worker\n");
+            return 0;
+        }
+    }
+}
+
+
+// Evaluate the brains of the pool on the workers (like evaluate for all the tasks)
+// Only one of the brains that are the same is evaluated (see same_as in struct evaluate_job_t)
+void distribute_evaluate(const struct genes_t *genepool, TYPE_VALUE *results, int best_brain, const int *same_as, int generation) {
+    int brains[POOL_SIZE], brain_num = 0, job_num, done_num = 0, waiting = 0;
+    int i, j, k, w, fd_num;
+    int stats[TASK_NUM * 4] = { 0 }; // target_1_num, best_brain_1_num, best_brain_correct_num, baseline_correct for each task
+    uint32_t first_id = distribute.next_job_id;
+    uint64_t command_num, pos;
+    struct distribute_job_t *jobs;
+    struct distribute_job_header_t *message;
+    struct checkpoint_entry_t *entries;
+    struct genes_command_t *commands;
+    struct pollfd fds[DISTRIBUTE_MAX_WORKERS + 1];
+    int fd_worker[DISTRIBUTE_MAX_WORKERS + 1];
+    
+    for(i=0; i<POOL_SIZE; i++) {
+        if(same_as[i] == i) { brains[brain_num++] = i; }
+    }
+    job_num = (brain_num + DISTRIBUTE_CHUNK - 1) / DISTRIBUTE_CHUNK;
+    distribute.next_job_id += job_num;
+    jobs = calloc(job_num, sizeof(struct distribute_job_t));
+    if(jobs == NULL) { die("Out of memory"); }
+    for(j=0; j<job_num; j++) {
+        int first = j * DISTRIBUTE_CHUNK, num = (brain_num - first < DISTRIBUTE_CHUNK ? brain_num - first : DISTRIBUTE_CHUNK);
+        command_num = 0;
+        for(k=0; k<num; k++) { command_num += genepool[brains[first + k]].length; }
+        jobs[j].size = sizeof(struct distribute_job_header_t) + num * sizeof(struct checkpoint_entry_t) + command_num * sizeof(struct genes_command_t);
+        message = jobs[j].message = calloc(1, jobs[j].size);
+        if(message == NULL) { die("Out of memory"); }
+        entries = (struct checkpoint_entry_t *)(message + 1);
+        commands = (struct genes_command_t *)(entries + num);
+        message->magic = DISTRIBUTE_JOB_MAGIC;
+        message->job_id = first_id + j;
+        message->seed = rng_seed;
+        message->generation = generation;
+        message->best_brain = -1;
+        message->genes_num = num;
+        message->command_num = command_num;
+        for(k=0, pos=0; k<num; k++) {
+            pos += checkpoint_pack(&genepool[brains[first + k]], brains[first + k], pos, &entries[k], commands);
+            if(best_brain >= 0 && brains[first + k] == same_as[best_brain]) { message->best_brain = brains[first + k]; }
         }
+        message->checksum = checkpoint_checksum(message + 1, jobs[j].size - sizeof(struct distribute_job_header_t));
     }
-    else if(signum == SIGUSR2) {
-        if(xpol_state == XPOL_UPLOAD) {
-            fprintf(stderr, "XPOL: upload done\n");
-            xpol_state = XPOL_NOOP;
+    
+    while(done_num < job_num) {
+        // Give out jobs
+        fd_num = 0;
+        for(w=0; w<DISTRIBUTE_MAX_WORKERS; w++) {
+            struct distribute_worker_t *worker = &distribute.workers[w];
+            if(worker->conn.fd == -1) { continue; }
+            while(worker->job_num < DISTRIBUTE_PIPELINE && (j = distribute_pick(worker, jobs, job_num, first_id)) != -1) {
+                xpol_buffer_add(&worker->conn.out, &worker->conn.out_len, &worker->conn.out_capacity, jobs[j].message, jobs[j].size);
+                worker->jobs[worker->job_num++] = first_id + j;
+                jobs[j].copies++;
+                jobs[j].sent = time(NULL);
+            }
+            if(!xpol_peer_write(&worker->conn)) {
+                distribute_close(w, jobs, job_num, first_id);
+                continue;
+            }
+            fds[fd_num].fd = worker->conn.fd;
+            fds[fd_num].events = POLLIN | (worker->conn.out_pos < worker->conn.out_len ? POLLOUT : 0);
+            fd_worker[fd_num++] = w;
         }
-        else {
-            die("Unexpected USR2 (upload)");
+        if(fd_num == 0 && !waiting) {
+            fprintf(stderr, "Coordinator: waiting for workers\n");
+            waiting = 1;
+        }
+        fds[fd_num].fd = distribute.listen_fd;
+        fds[fd_num].events = POLLIN;
+        fd_worker[fd_num++] = -1;
+        
+        if(poll(fds, fd_num, 1000) < 0) {
+            if(errno == EINTR) { continue; }
+            die("Coordinator: poll failed");
+        }
+        for(k=0; k<fd_num; k++) {
+            if(fd_worker[k] == -1) {
+                if(fds[k].revents & POLLIN) { distribute_accept(); }
+                continue;
+            }
+            if((fds[k].revents & (POLLIN | POLLHUP | POLLERR)) && !distribute_read(&distribute.workers[fd_worker[k]], jobs, job_num, first_id, results, stats, &done_num)) {
+                distribute_close(fd_worker[k], jobs, job_num, first_id);
+            }
         }
     }
-    else {
-        die("Unexpected signal");
+    
+    // Brains that are the same share the results
+    for(i=0; i<POOL_SIZE; i++) {
+        if(same_as[i] != i) { results[i] = results[same_as[i]]; }
     }
+    for(j=0; j<TASK_NUM; j++) { evaluate_log(best_brain, stats[j * 4], stats[j * 4 + 1], stats[j * 4 + 2], stats[j * 4 + 3]); }
+    for(j=0; j<job_num; j++) { free(jobs[j].message); }
+    free(jobs);
 }
 
 
-// Start uploading some genes
-void xpol_upload(const struct genes_t *genes) {
-    if(xpol_target_pid == -1) { return; }
-    if(xpol_state != XPOL_NOOP) {
-        fprintf(stderr, "XPOL: Cannot start uploading\n");
-        return;
+// Receive exactly size bytes
+// Returns success
+int distribute_recv(int fd, void *buf, size_t size) {
+    ssize_t got;
+    while(size > 0) {
+        got = recv(fd, buf, size, 0);
+        if(got < 0 && errno == EINTR) { continue; }
+        if(got <= 0) { return 0; }
+        buf = (char *)buf + got;
+        size -= got;
     }
-    xpol_state = XPOL_UPLOAD;
-    fprintf(stderr, "XPOL: upload started\n");
-    FILE *outfile = fopen("xpol.dat", "w+");
-    if(outfile == NULL) { die("Cannot open file"); }
-    genes_write(genes, outfile, 0);
-    fclose(outfile);
-    if(kill(xpol_target_pid, SIGUSR2) != 0) {
-        die("Cannot send signal");
+    return 1;
+}
+
+
+// Send exactly size bytes
+// Returns success
+int distribute_send(int fd, const void *buf, size_t size) {
+    ssize_t sent;
+    while(size > 0) {
+        sent = send(fd, buf, size, MSG_NOSIGNAL);
+        if(sent < 0 && errno == EINTR) { continue; }
+        if(sent <= 0) { return 0; }
+        buf = (const char *)buf + sent;
+        size -= sent;
     }
+    return 1;
 }
 
 
-// Request downloading genes
-void xpol_request_download() {
-    if(xpol_target_pid == -1) { return; }
-    if(xpol_state != XPOL_NOOP) {
-        fprintf(stderr, "XPOL: Cannot start downloading\n");
-        return;
+// Do a job received from the coordinator, and fill in the result (which has room for the correct answers)
+// Returns success
+int distribute_do_job(const struct distribute_job_header_t *header, struct genes_t *genepool, struct brain_t *brainpool,
+        struct task_t *task, struct evaluate_job_t *job, TYPE_VALUE *results, struct distribute_result_header_t *result) {
+    const struct checkpoint_entry_t *entries = (const struct checkpoint_entry_t *)(header + 1);
+    const struct genes_command_t *commands = (const struct genes_command_t *)(entries + header->genes_num);
+    int32_t *correct = (int32_t *)(result + 1);
+    struct rng_t rng;
+    int k, t, slot;
+    
+    if(header->checksum != checkpoint_checksum(header + 1, header->genes_num * sizeof(struct checkpoint_entry_t) + header->command_num * sizeof(struct genes_command_t))) { return 0; }
+    rng_seed = header->seed;
+    job->active_num = 0;
+    for(k=0; k<(int)header->genes_num; k++) {
+        slot = entries[k].slot;
+        if(slot >= POOL_SIZE || !xpol_check_genes(&entries[k], commands, header->command_num)) { return 0; }
+        checkpoint_entry_genes(&entries[k], commands + entries[k].first, &genepool[slot]);
+        rng_init(&rng, RNG_BREED, header->generation, slot); // not used as the genes have no random arguments any more
+        genes_create_brain(&genepool[slot], &brainpool[slot], &rng);
+        results[slot] = 0;
+        job->active[job->active_num++] = slot;
     }
-    xpol_state = XPOL_DOWNLOAD;
-    fprintf(stderr, "XPOL: download requested\n");
-    if(kill(xpol_target_pid, SIGUSR1) != 0) {
-        die("Cannot send signal");
+    
+    memset(result, 0, sizeof(struct distribute_result_header_t));
+    result->magic = DISTRIBUTE_RESULT_MAGIC;
+    result->job_id = header->job_id;
+    result->genes_num = header->genes_num;
+    job->brainpool = brainpool;
+    job->results = results;
+    job->best_brain = header->best_brain;
+    job->same_as = NULL;
+    job->generation = header->generation;
+    job->question_from = 0;
+    job->question_to = STEPS;
+    for(t=0; t<TASK_NUM; t++) {
+        task_init(task, header->generation, t);
+        job->task_no = t;
+        job->task = task;
+        job->next_brain = 0;
+        job->best_brain_1_num = 0;
+        job->best_brain_correct_num = 0;
+        threads_run(evaluate_worker, job);
+        result->target_1_num[t] = task->target_1_num;
+        result->baseline_correct[t] = task->baseline_correct;
+        result->best_brain_1_num[t] = job->best_brain_1_num;
+        result->best_brain_correct_num[t] = job->best_brain_correct_num;
     }
+    for(k=0; k<(int)header->genes_num; k++) { correct[k] = results[entries[k].slot]; }
+    return 1;
 }
 
 
-// Perform anything necessary
-// Returns if anything happened
-int xpol_tick(struct genes_t *genes_target) {
-    if(xpol_target_pid == -1) { return 0; }
-    if(xpol_state == XPOL_DOWNLOAD_READY) {
-        fprintf(stderr, "XPOL: Download ready, injecting\n");
-        FILE *outfile = fopen("xpol.dat", "r");
-        if(outfile == NULL) { die("Cannot open file"); }
-        genes_read(genes_target, outfile);
-        fclose(outfile);        
-        xpol_state = XPOL_NOOP;
-        return 1;
+// Work for a coordinator: connect to it and do the jobs it sends. Never returns
+void distribute_worker(const char *address_name) {
+    struct sockaddr_storage address;
+    socklen_t address_len;
+    struct distribute_job_header_t header;
+    struct distribute_job_header_t *message = NULL;
+    struct distribute_result_header_t *result = NULL;
+    size_t size, result_size;
+    int fd, failed = 0, job_count = 0;
+    struct genes_t *genepool = genes_alloc(POOL_SIZE);
+    struct brain_t *brainpool = brain_alloc(POOL_SIZE);
+    struct task_t *task = task_alloc();
+    struct evaluate_job_t *job = malloc(sizeof(struct evaluate_job_t));
+    TYPE_VALUE *results = malloc(POOL_SIZE * sizeof(TYPE_VALUE));
+    
+    if(job == NULL || results == NULL) { die("Out of memory"); }
+    if(!xpol_address(address_name, &address, &address_len)) { die("Wrong usage - wrong coordinator address"); }
+    while(1) {
+        fd = socket(address.ss_family, SOCK_STREAM, 0);
+        if(fd < 0 || connect(fd, (struct sockaddr *)&address, address_len) != 0) {
+            if(fd >= 0) { close(fd); }
+            if(!failed) { fprintf(stderr, "Worker: cannot connect to %s, retrying\n", address_name); }
+            failed = 1;
+            sleep(1);
+            continue;
+        }
+        fprintf(stderr, "Worker: connected to %s\n", address_name);
+        failed = 0;
+        while(distribute_recv(fd, &header, sizeof(header))) {
+            if(header.magic != DISTRIBUTE_JOB_MAGIC || header.genes_num > POOL_SIZE || header.command_num > XPOL_MAX_MESSAGE / sizeof(struct genes_command_t)) { break; }
+            size = sizeof(header) + header.genes_num * sizeof(struct checkpoint_entry_t) + header.command_num * sizeof(struct genes_command_t);
+            message = realloc(message, size);
+            result_size = sizeof(struct distribute_result_header_t) + header.genes_num * sizeof(int32_t);
+            result = realloc(result, result_size);
+            if(message == NULL || result == NULL) { die("Out of memory"); }
+            memcpy(message, &header, sizeof(header));
+            if(!distribute_recv(fd, message + 1, size - sizeof(header))) { break; }
+            if(!distribute_do_job(message, genepool, brainpool, task, job, results, result)) {
+                fprintf(stderr, "Worker: invalid job\n");
+                break;
+            }
+            if(!distribute_send(fd, result, result_size)) { break; }
+            job_count++;
+            if(job_count % 100 == 0) { fprintf(stderr, "Worker: %d jobs done\n", job_count); }
+        }
+        fprintf(stderr, "Worker: connection to %s lost\n", address_name);
+        close(fd);
     }
-    return 0;
 }
 
 
 // =======================================================================================================================
 
 
-// Compare numbers
-static int cmpint(const void *p1, const void *p2) { return ( *((TYPE_VALUE*)p1) > *((TYPE_VALUE*)p2) ) - ( *((TYPE_VALUE*)p1) < *((TYPE_VALUE*)p2) ); }
+void dump_genepool(const struct genes_t *genepool, int generation) {
+    int full = ((generation % CHECKPOINT_INTERVAL) == 0);
+    if(!full && !CHECKPOINT_JOURNAL) { return; }
+    fprintf(stderr, (full ? "Writing gene pool to file...\n" : "Writing changed genes to the journal...\n"));
+    checkpoint_start(genepool, generation, full);
+}
 
 
-void dump_genepool(struct genes_t *genepool) {
-    fprintf(stderr, "Writing gene pool to file...\n");
-    FILE *outfile = fopen("genepool.dat", "w+");
-    if(outfile == NULL) { die("Cannot open file"); }
-    fprintf(outfile, "genepool_v1\n# Pool size:\n%d\n", POOL_SIZE);
-    for(int i=0; i<POOL_SIZE; i++) { genes_write(&genepool[i], outfile, 1); }
-    for(int i=0; i<POOL_SIZE; i++) { genes_write(&genepool[i], outfile, 0); }
-    fclose(outfile);
+
+
+// ==== ISLANDS ==================================================================================================================
+// One process can evolve several separate pools, islands, side by side (--islands N). Each island runs the evolution
+// in its own thread with its own worker threads (--threads is per island) pinned to its own CPUs, and has its own
+// random streams and checkpoint files (island1-genepool.dat etc.).
+// Every ISLAND_INTERVAL generations an island sends its best genes to other islands (--topology ring: to the next one,
+// random: to a random one, full: to all of them). They wait in the inbox of the island they were sent to, and are
+// injected into it as migrants, like the genes from other pools (see XPOL). Only island 0 talks to other pools.
+// The state of an island is kept in thread-local variables (rng_seed, threads, race, checkpoint_writer)
+
+#define ISLAND_INTERVAL 2 // generations between sending genes
+#define ISLAND_BATCH 2 // how many of the best genes to send
+#define ISLAND_QUEUE 16 // genes waiting in an inbox (more are dropped)
+#define MAX_ISLANDS 64
+
+#define TOPOLOGY_RING 1
+#define TOPOLOGY_RANDOM 2
+#define TOPOLOGY_FULL 3
+
+struct island_t {
+    int id;
+    uint64_t seed;
+    pthread_t thread;
+    pthread_mutex_t mutex; // protects the inbox
+    struct genes_t *inbox; // [ISLAND_QUEUE] genes sent by other islands
+    int inbox_first;
+    int inbox_num;
+};
+
+struct islands_t {
+    int num;
+    int topology;
+    int threads; // per island
+    int racing;
+    int load_genes;
+    const char *metrics_file; // or NULL (see METRICS)
+    struct island_t island[MAX_ISLANDS];
+};
+struct islands_t islands = { .num = 1, .topology = TOPOLOGY_RING, .metrics_file = NULL };
+
+
+// Put genes into the inbox of an island
+void island_put(struct island_t *island, const struct genes_t *genepool, const int *slots, int slot_num) {
+    int k;
+    pthread_mutex_lock(&island->mutex);
+    for(k=0; k<slot_num && island->inbox_num<ISLAND_QUEUE; k++) {
+        genes_clone(&genepool[slots[k]], &island->inbox[(island->inbox_first + island->inbox_num) % ISLAND_QUEUE]);
+        island->inbox_num++;
+    }
+    pthread_mutex_unlock(&island->mutex);
+    if(k < slot_num) { fprintf(stderr, "Island %d: inbox full, %d genes dropped\n", island->id, slot_num - k); }
 }
 
 
-void load_genepool(struct genes_t *genepool) {
-    fprintf(stderr, "Loading gene pool from file...\n");
-    FILE *outfile = fopen("genepool.dat", "r");
-    if(outfile == NULL) { die("Cannot open file"); }
-    size_t memlen = 0;
-    char *membuf = NULL;
-    int ret;
-    int lineno = 0;
-    int pool_size;
-    
-    while(1) {
-        ret = getline(&membuf, &memlen, outfile);
-        if(ret < 0) {
-            free(membuf);
-            die("Error while reading file");
-        }
-        if(membuf[0] == '#') { continue; }
-        if(ret > 100) { die("Line too long"); }
-        if(lineno == 0 && strcmp(membuf, "genepool_v1\n") != 0) { die("Genepool signature error"); }
-        if(lineno == 1) {
-            if(sscanf(membuf, "%d", &pool_size) != 1) { die("Genepool error 2"); }
-            if(pool_size != POOL_SIZE) { die("Pool size mismatch"); }
-            break;
+// Send the genes in the given slots to other islands
+void island_send(const struct island_t *island, const struct genes_t *genepool, const int *slots, int slot_num, int generation) {
+    struct rng_t rng;
+    int to;
+    if(islands.num < 2) { return; }
+    if(islands.topology == TOPOLOGY_RING) {
+        island_put(&islands.island[(island->id + 1) % islands.num], genepool, slots, slot_num);
+    }
+    else if(islands.topology == TOPOLOGY_RANDOM) {
+        rng_init(&rng, RNG_MIGRATE, generation, island->id);
+        to = getrand(&rng) * (islands.num - 1);
+        if(to >= island->id) { to++; }
+        island_put(&islands.island[to], genepool, slots, slot_num);
+    }
+    else {
+        for(to=0; to<islands.num; to++) {
+            if(to != island->id) { island_put(&islands.island[to], genepool, slots, slot_num); }
         }
-        lineno++;
     }
-    for(int i=0; i<POOL_SIZE; i++) { genes_read(&genepool[i], outfile); }
-    free(membuf);
-    fclose(outfile);
-    fprintf(stderr, "Loading gene pool from file done.\n");
 }
 
 
-// Usage: $0 PID [new]
-// Use PID=-1 to disable
-int main(int argc, char **argv) {
-    int p_load_genes = 1;
+// Add the genes in the inbox of the island to the migrants, up to XPOL_INJECT (the others wait in the inbox)
+// Returns the number of migrants
+int island_receive(struct island_t *island, struct genes_t *migrants, int migrant_num) {
+    pthread_mutex_lock(&island->mutex);
+    while(migrant_num < XPOL_INJECT && island->inbox_num > 0) {
+        genes_clone(&island->inbox[island->inbox_first], &migrants[migrant_num++]);
+        genes_clear(&island->inbox[island->inbox_first]);
+        island->inbox_first = (island->inbox_first + 1) % ISLAND_QUEUE;
+        island->inbox_num--;
+    }
+    pthread_mutex_unlock(&island->mutex);
+    return migrant_num;
+}
+
+
+// Evolve the pool of an island
+void *island_main(void *arg) {
+    struct island_t *island = arg;
     int i, j, evo_steps=0;
     struct task_t *task;
+    struct rng_t rng;
+    double start;
+    char prefix[32] = "";
     
-    signal(SIGUSR1, xpol_sig_handler);
-    signal(SIGUSR2, xpol_sig_handler);
-    
-    if(argc >= 2 && argc <= 3) {
-        if(sscanf(argv[1], "%d", &xpol_target_pid) != 1) { die("Wrong usage - wrong pid"); }
-        if(argc == 3 && strcmp(argv[2], "new") == 0) { p_load_genes = 0; }
+    rng_seed = island->seed;
+    race.on = islands.racing;
+    if(islands.num > 1) {
+        snprintf(prefix, sizeof(prefix), "island%d-", island->id);
+        checkpoint_set_prefix(prefix);
     }
-    else {
-        die("Wrong usage");
+    if(islands.metrics_file != NULL) {
+        char filename[256];
+        snprintf(filename, sizeof(filename), "%s%s", prefix, islands.metrics_file);
+        metrics_open(filename, island->id);
     }
-    fprintf(stderr, "My pid: %d XPOL target pid: %d\n", getpid(), xpol_target_pid);
-    
-    // See also https://linux.die.net/man/3/random_r
-    srandom(time(NULL));
+    threads_init(islands.threads, (islands.num > 1 ? island->id * islands.threads : -1));
     
     struct genes_t *genepool;
     genepool = genes_alloc(POOL_SIZE);
     struct brain_t *brainpool;
     brainpool = brain_alloc(POOL_SIZE);
     
-    if(p_load_genes) {
-        load_genepool(genepool);
+    if(islands.load_genes) {
+        struct checkpoint_t checkpoint;
+        fprintf(stderr, "Loading gene pool from file...\n");
+        checkpoint_open(&checkpoint, checkpoint_writer.file);
+        checkpoint_journal_replay(&checkpoint, checkpoint_writer.journal_file);
+        pool_init(genepool, brainpool, &checkpoint);
+        checkpoint_close(&checkpoint);
+        fprintf(stderr, "Loading gene pool from file done.\n");
     }
     else {
         fprintf(stderr, "Initializing new gene pool...\n");
-        for(i=0; i<POOL_SIZE; i++) {
-            genes_init(&genepool[i]);
-            genes_mutate(&genepool[i]);
-            // genes_print(&genepool[i]);
-        }
-    }
-        
-    for(i=0; i<POOL_SIZE; i++) {
-        genes_create_brain(&genepool[i], &brainpool[i]);
+        pool_init(genepool, brainpool, NULL);
     }
+    for(i=0; i<POOL_SIZE; i++) { race.offspring[i] = 1; }
+    arena_log("Brain", &brain_arena);
+    arena_log("Gene", &genes_arena);
     
     TYPE_VALUE results[POOL_SIZE];
     TYPE_VALUE penalty[POOL_SIZE];
-    TYPE_VALUE results2[POOL_SIZE];
+    int rank[POOL_SIZE];
+    char role[POOL_SIZE];
+    int pairs[POOL_SIZE][2], pair_num;
     TYPE_VALUE v;
     task = task_alloc();
-    int best_brain = -1, mutations, mutations_i;
+    int best_brain = -1;
+    int same_as[POOL_SIZE], duplicate_num;
+    struct genes_t *migrants = genes_alloc(XPOL_INJECT);
+    int migrant_num;
     
     while(1) {
         
@@ -1216,31 +4718,66 @@ int main(int argc, char **argv) {
         for(i=0; i<POOL_SIZE; i++) {
             // We add a bit of randomness because there are too many results that are the same
             results[i] = 0;
-            penalty[i] = GENE_LENGTH_PENALTY * (genepool[i].length + getrand() / 2.) + THINKING_TIME_PENALTY * genepool[i].thinking_time;
+            rng_init(&rng, RNG_PENALTY, evo_steps, i);
+            penalty[i] = GENE_LENGTH_PENALTY * (genepool[i].length + getrand(&rng) / 2.) + THINKING_TIME_PENALTY * genepool[i].thinking_time;
+        }
+        // How much of the brains can be left out when thinking (see brain_find_live)
+        long live_weights = 0, all_weights = 0, live_sumsis = 0, all_sumsis = 0;
+        for(i=0; i<POOL_SIZE; i++) {
+            live_weights += brainpool[i].weight_num - 1;
+            all_weights += brainpool[i].constr_weight_num - 1;
+            live_sumsis += brainpool[i].sumsi_num - 1;
+            all_sumsis += brainpool[i].constr_sumsi_num - 1;
         }
+        fprintf(stderr, "Dead units pruned: weights %ld of %ld (%.1f%%) sumsis %ld of %ld (%.1f%%)\n",
+            all_weights - live_weights, all_weights, (all_weights ? 100. * (all_weights - live_weights) / all_weights : 0.),
+            all_sumsis - live_sumsis, all_sumsis, (all_sumsis ? 100. * (all_sumsis - live_sumsis) / all_sumsis : 0.));
         if(best_brain != -1) { fprintf(stderr, "Best brain: %d Length: %d Thinking time: %f LR: %f Penalty: %f Length penalty: %f Time penalty: %f\n", best_brain, genepool[best_brain].length, genepool[best_brain].thinking_time, genepool[best_brain].learning_rate, penalty[best_brain], GENE_LENGTH_PENALTY, THINKING_TIME_PENALTY); }
         
-        for(j=0; j<TASK_NUM; j++) {
-            // Create a new task
-            task_init(task);
-            // Give the task to the brains
-            evaluate(brainpool, task, results, best_brain);
+        // Brains with identical genes are the same, so they only need to be evaluated once
+        duplicate_num = genes_find_duplicates(genepool, POOL_SIZE, same_as);
+        fprintf(stderr, "Dedup: %d of %d genes are duplicates (%.1f%%)%s\n", duplicate_num, POOL_SIZE, 100. * duplicate_num / POOL_SIZE, (DEDUP_OWN_NOISE ? " but have their own noise" : ""));
+        if(DEDUP_OWN_NOISE) { for(i=0; i<POOL_SIZE; i++) { same_as[i] = i; } }
+        
+        if(race.on) { race_start(penalty, same_as); }
+        if(distribute.on) {
+            // The workers make the tasks and give them to the brains
+            start = metrics_now();
+            distribute_evaluate(genepool, results, best_brain, same_as, evo_steps);
+            metrics_add(METRICS_EVALUATE, start);
+        }
+        else {
+            for(j=0; j<TASK_NUM; j++) {
+                // Create a new task
+                start = metrics_now();
+                task_init(task, evo_steps, j);
+                metrics_add(METRICS_TASK_INIT, start);
+                // Give the task to the brains
+                start = metrics_now();
+                evaluate(brainpool, task, results, best_brain, same_as, evo_steps, j);
+                metrics_add(METRICS_EVALUATE, start);
+            }
         }
+        metrics_count(genepool, brainpool, same_as);
+        // The savings of racing only, as duplicates are not evaluated anyway
+        if(race.on) { fprintf(stderr, "Racing: stopped %d of %d brains (%d prescreened) Questions answered: %.1f%%\n", race.stopped_num, race.brain_num, race.prescreened_num, 100. * race.answered_num / race.brain_num / TASK_NUM / STEPS); }
+        for(i=0; i<POOL_SIZE; i++) { race.offspring[i] = 0; }
     
-        // Order the brains - best LAST!
+        // Rank the brains - best LAST!
         // worst                                               best
         // |------------------------------------------------------|
         // 0                                              POOL_SIZE
         //                              |--- SIZE - KEEP ---------| top ones
         //                    |------- POOL_KEEP -----------------| keep me
+        start = metrics_now();
         for(i=0; i<POOL_SIZE; i++) {
             results[i] -= penalty[i];
-            results2[i] = results[i];
         }
-        qsort(results2, POOL_SIZE, sizeof(TYPE_VALUE), cmpint);
-        TYPE_VALUE best_value = results2[POOL_SIZE - 1];
-        TYPE_VALUE top_limit_value = results2[POOL_KEEP + 2]; // selects the top POOL_SIZE - POOL_KEEP - 2 many (keep 2 for the crossover and XPOL)
-        TYPE_VALUE limit_value = results2[POOL_SIZE - POOL_KEEP];
+        select_rank(results, rank);
+        metrics_add(METRICS_SELECT, start);
+        TYPE_VALUE best_value = results[rank[POOL_SIZE - 1]];
+        TYPE_VALUE top_limit_value = results[rank[POOL_KEEP + 2]]; // selects the top POOL_SIZE - POOL_KEEP - 2 many (keep 2 for the crossover)
+        TYPE_VALUE limit_value = results[rank[POOL_SIZE - POOL_KEEP]];
         fprintf(stderr,
             "Best score: %f=%f%% at %d Top limit: %f = %f%% at %d Keep limit: %f=%f%% at %d\n",
             best_value,
@@ -1255,80 +4792,217 @@ int main(int argc, char **argv) {
         );
         // write_debug_file("00best");
         
-        // Now clone and mutate the top performers (POOL_SIZE - POOL_KEEP many)
-        // There may be some edge cases, but whatever.
+        best_brain = rank[POOL_SIZE - 1];
+        v = results[best_brain] + penalty[best_brain];
+        fprintf(stderr, "Best brain: %d Performance: %f=%f%% Penalty: %f\n", best_brain, v, v/STEPS/TASK_NUM*100., penalty[best_brain]);
+        if(islands.num > 1) { fprintf(stderr, "Island %d: generation %d best score: %f=%f%%\n", island->id, evo_steps, best_value, best_value / STEPS / TASK_NUM * 100.); }
+        
+        // Send the best genes to the other pools and islands
+        start = metrics_now();
+        if(island->id == 0 && (evo_steps % XPOL_INTERVAL) == 0) { xpol_send(genepool, &rank[POOL_SIZE - XPOL_BATCH], XPOL_BATCH, evo_steps); }
+        if((evo_steps % ISLAND_INTERVAL) == 0) { island_send(island, genepool, &rank[POOL_SIZE - ISLAND_BATCH], ISLAND_BATCH, evo_steps); }
+        metrics_add(METRICS_XPOL, start);
+        
+        // Now clone and mutate the top performers (POOL_SIZE - POOL_KEEP - 2 many) into the bottom ones,
+        // pairing them up in the order of their numbers. The first two bottom ones are for the crossover.
+        // The worst ones are left for the migrants from other pools and islands, if there are any
         int source_ix = 0;
-        int target_ix = 0;
+        int target_ix;
         int cloned = 0;
-        best_brain = -1;
+        int rebuilt_commands, rebuilt_length = 0; // stats
         int crossover_target[2];
-        for(i=0; i<POOL_SIZE; i++) {
-            if(results[i] == best_value) { 
-                best_brain = i;
-                v = results[best_brain] + penalty[best_brain];
-                fprintf(stderr, "Best brain: %d Performance: %f=%f%% Penalty: %f\n", best_brain, v, v/STEPS/TASK_NUM*100., penalty[best_brain]);
-                break; 
-            }
-        }
+        for(i=0; i<POOL_SIZE; i++) { role[i] = 0; }
+        for(i=0; i<POOL_SIZE - POOL_KEEP; i++) { role[rank[i]] = 'T'; }
+        start = metrics_now();
+        migrant_num = (island->id == 0 ? xpol_receive(migrants, 0) : 0);
+        migrant_num = island_receive(island, migrants, migrant_num);
+        metrics_add(METRICS_XPOL, start);
+        for(i=0; i<migrant_num; i++) { role[rank[i]] = 'X'; }
+        for(i=POOL_KEEP + 2; i<POOL_SIZE; i++) { role[rank[i]] = 'S'; }
+        pair_num = 0;
         write_debug_file("10preloop");
-        while(1) {
-            write_debug_file("19loop");
-            while(results[target_ix] >= limit_value && target_ix < POOL_SIZE) { target_ix++; }
-            while(results[source_ix] < top_limit_value && source_ix < POOL_SIZE) { source_ix++; }
-            if(source_ix >= POOL_SIZE || target_ix >= POOL_SIZE) { break; }
-            
+        for(target_ix=0; target_ix<POOL_SIZE; target_ix++) {
+            if(role[target_ix] != 'T') { continue; }
             if(cloned < 2) {
                 crossover_target[cloned] = target_ix;
                 cloned++;
-                target_ix++;
                 continue;
             }
-            write_debug_file("20clone");
-            
-            // printf("Copying %d (res %f) to %d (res %f)\n", source_ix, results[source_ix], target_ix, results[target_ix]);
-            genes_clone(&genepool[source_ix], &genepool[target_ix]);
-            mutations = getrand() * 5;
-            for(mutations_i=0; mutations_i<=mutations; mutations_i++) {
-                genes_mutate(&genepool[target_ix]);
-            }
-            // Regenerate brain
-            genes_create_brain(&genepool[target_ix], &brainpool[target_ix]);
-            write_debug_file("28finish");
+            while(source_ix < POOL_SIZE && role[source_ix] != 'S') { source_ix++; }
+            if(source_ix >= POOL_SIZE) { break; }
+            pairs[pair_num][0] = source_ix;
+            pairs[pair_num][1] = target_ix;
+            pair_num++;
             source_ix++;
-            target_ix++;
             cloned++;
-            write_debug_file("29endloop");
+        }
+        write_debug_file("20clone");
+        start = metrics_now();
+        rebuilt_commands = breed(genepool, brainpool, pairs, pair_num, evo_steps);
+        for(i=0; i<pair_num; i++) {
+            rebuilt_length += genepool[pairs[i][1]].length;
+            race.offspring[pairs[i][1]] = 1;
+            checkpoint_mark(pairs[i][1]);
         }
         write_debug_file("40cloned");
-        fprintf(stderr, "Cloned: %d\n", cloned);
+        fprintf(stderr, "Cloned: %d Rebuilt from snapshots: %d of %d commands processed\n", cloned, rebuilt_commands, rebuilt_length);
+        if(migrant_num > 0) { pool_inject(genepool, brainpool, migrants, migrant_num, rank, evo_steps); }
+        metrics_add(METRICS_CLONE_MUTATE, start);
         
         // Crossover
         // Now we have reasonably good brains
+        start = metrics_now();
         int crossover_source;
+        rng_init(&rng, RNG_CROSSOVER, evo_steps, 0);
         while(1) {
-            crossover_source = getrand() * POOL_SIZE;
+            crossover_source = getrand(&rng) * POOL_SIZE;
             if(crossover_source != best_brain && crossover_source != crossover_target[0] && crossover_source != crossover_target[1]) { break; }
         }
         fprintf(stderr, "Crossover %d, %d -> %d, %d\n", best_brain, crossover_source, crossover_target[0], crossover_target[1]);
         write_debug_file("50costart");
-        genes_crossover(&genepool[best_brain], &genepool[crossover_source], &genepool[crossover_target[0]], &genepool[crossover_target[1]]);
+        genes_crossover(&genepool[best_brain], &genepool[crossover_source], &genepool[crossover_target[0]], &genepool[crossover_target[1]], &rng);
+        int crossover_base[2] = { best_brain, crossover_source }; // the brains the new genes derive from
+        checkpoint_mark(crossover_target[0]);
+        checkpoint_mark(crossover_target[1]);
+        metrics_add(METRICS_CROSSOVER, start);
 
         // Save to file
-        if((evo_steps % 10) == 0) { dump_genepool(genepool); }
+        start = metrics_now();
+        dump_genepool(genepool, evo_steps);
+        metrics_add(METRICS_CHECKPOINT, start);
         
-        if((evo_steps % 50) == 0) { xpol_upload(&genepool[best_brain]); }
-        if((evo_steps % 50) == 10) { xpol_request_download(); }
-
-        if(xpol_tick(&genepool[crossover_target[1]])) {
-            fprintf(stderr, "XPOL injected into %d. We'll report on this brain in the next step\n", crossover_target[1]);
-            best_brain = crossover_target[1];
+        start = metrics_now();
+        for(i=0; i<2; i++) {
+            rng_init(&rng, RNG_BREED, evo_steps, crossover_target[i]);
+            genes_rebuild_brain(&genepool[crossover_target[i]], &brainpool[crossover_target[i]], &brainpool[crossover_base[i]], &rng);
+            race.offspring[crossover_target[i]] = 1;
         }
-        genes_create_brain(&genepool[crossover_target[0]], &brainpool[crossover_target[0]]);
-        genes_create_brain(&genepool[crossover_target[1]], &brainpool[crossover_target[1]]);
+        metrics_add(METRICS_CROSSOVER, start);
+        metrics_add(METRICS_CREATE_BRAIN, start);
         
+        metrics_write(evo_steps);
         evo_steps++;
         write_debug_file("999endloop");
     }
-        
+    
+    return NULL;
+}
+
+
+// =======================================================================================================================
+
+
+#ifndef BENCH // bench.c has its own main
+// Usage: $0 [--threads N] [--seed N] [--racing] [--islands N] [--topology ring|random|full] [--metrics FILE]
+//           [--xpol-listen ADDRESS] [--xpol-connect ADDRESS] [--coordinator ADDRESS] POOL_ID [new]
+//        $0 [--threads N] --worker ADDRESS (evaluate brains for the coordinator, see DISTRIBUTE)
+//        $0 --convert FROM TO (between the binary and the text gene pool format)
+// ADDRESS is unix:PATH or HOST:PORT (see XPOL). POOL_ID identifies the pool in the cross-pool messages
+// --threads is the number of threads for each island (see ISLANDS)
+// Runs with the same seed are identical whatever the number of threads (but not with migrants, which come when they do)
+int main(int argc, char **argv) {
+    int p_load_genes = 1;
+    int p_threads = 1;
+    unsigned long long p_seed = time(NULL);
+    int i;
+    int argi = 1;
+    const char *p_xpol_listen = NULL;
+    const char *p_xpol_connect = NULL;
+    const char *p_coordinator = NULL;
+    const char *p_worker = NULL;
+    int p_pool_id;
+    
+    while(argi < argc && strncmp(argv[argi], "--", 2) == 0) {
+        if(strcmp(argv[argi], "--threads") == 0 && argi + 1 < argc) {
+            if(sscanf(argv[argi + 1], "%d", &p_threads) != 1 || p_threads < 1 || p_threads > MAX_THREADS) { die("Wrong usage - wrong number of threads"); }
+            argi += 2;
+        }
+        else if(strcmp(argv[argi], "--seed") == 0 && argi + 1 < argc) {
+            if(sscanf(argv[argi + 1], "%llu", &p_seed) != 1) { die("Wrong usage - wrong seed"); }
+            argi += 2;
+        }
+        else if(strcmp(argv[argi], "--racing") == 0) {
+            islands.racing = 1;
+            argi++;
+        }
+        else if(strcmp(argv[argi], "--metrics") == 0 && argi + 1 < argc) {
+            islands.metrics_file = argv[argi + 1];
+            argi += 2;
+        }
+        else if(strcmp(argv[argi], "--islands") == 0 && argi + 1 < argc) {
+            if(sscanf(argv[argi + 1], "%d", &islands.num) != 1 || islands.num < 1 || islands.num > MAX_ISLANDS) { die("Wrong usage - wrong number of islands"); }
+            argi += 2;
+        }
+        else if(strcmp(argv[argi], "--topology") == 0 && argi + 1 < argc) {
+            if(strcmp(argv[argi + 1], "ring") == 0) { islands.topology = TOPOLOGY_RING; }
+            else if(strcmp(argv[argi + 1], "random") == 0) { islands.topology = TOPOLOGY_RANDOM; }
+            else if(strcmp(argv[argi + 1], "full") == 0) { islands.topology = TOPOLOGY_FULL; }
+            else { die("Wrong usage - wrong topology"); }
+            argi += 2;
+        }
+        else if(strcmp(argv[argi], "--xpol-listen") == 0 && argi + 1 < argc) {
+            p_xpol_listen = argv[argi + 1];
+            argi += 2;
+        }
+        else if(strcmp(argv[argi], "--xpol-connect") == 0 && argi + 1 < argc) {
+            p_xpol_connect = argv[argi + 1];
+            argi += 2;
+        }
+        else if(strcmp(argv[argi], "--coordinator") == 0 && argi + 1 < argc) {
+            p_coordinator = argv[argi + 1];
+            argi += 2;
+        }
+        else if(strcmp(argv[argi], "--worker") == 0 && argi + 1 < argc) {
+            p_worker = argv[argi + 1];
+            argi += 2;
+        }
+        else if(strcmp(argv[argi], "--convert") == 0 && argi + 2 < argc) {
+            checkpoint_convert(argv[argi + 1], argv[argi + 2]);
+            return 0;
+        }
+        else {
+            die("Wrong usage - unknown option");
+        }
+    }
+    if(p_worker != NULL) {
+        if(argi != argc) { die("Wrong usage"); }
+        brain_select_kernels();
+        threads_init(p_threads, -1);
+        distribute_worker(p_worker);
+    }
+    if(argc - argi >= 1 && argc - argi <= 2) {
+        if(sscanf(argv[argi], "%d", &p_pool_id) != 1) { die("Wrong usage - wrong pool id"); }
+        if(argc - argi == 2 && strcmp(argv[argi + 1], "new") == 0) { p_load_genes = 0; }
+    }
+    else {
+        die("Wrong usage");
+    }
+    fprintf(stderr, "My pid: %d Pool id: %d\n", getpid(), p_pool_id);
+    if(p_xpol_listen != NULL || p_xpol_connect != NULL) { xpol_start(p_pool_id, p_xpol_listen, p_xpol_connect); }
+    if(p_coordinator != NULL) {
+        if(islands.racing || islands.num > 1) { die("Wrong usage - racing and islands cannot be used with workers"); }
+        distribute_start(p_coordinator);
+    }
+    
+    fprintf(stderr, "Seed: %llu\n", p_seed);
+    brain_select_kernels();
+    
+    islands.threads = p_threads;
+    islands.load_genes = p_load_genes;
+    if(islands.num > 1) { fprintf(stderr, "Islands: %d Topology: %s\n", islands.num, (islands.topology == TOPOLOGY_RING ? "ring" : islands.topology == TOPOLOGY_RANDOM ? "random" : "full")); }
+    for(i=0; i<islands.num; i++) {
+        islands.island[i].id = i;
+        islands.island[i].seed = (i == 0 ? p_seed : rng_mix(p_seed + 0x9E3779B97F4A7C15ULL * (uint64_t)i));
+        if(pthread_mutex_init(&islands.island[i].mutex, NULL) != 0) { die("Cannot create mutex"); }
+        islands.island[i].inbox = genes_alloc(ISLAND_QUEUE);
+        islands.island[i].inbox_first = 0;
+        islands.island[i].inbox_num = 0;
+    }
+    for(i=1; i<islands.num; i++) {
+        if(pthread_create(&islands.island[i].thread, NULL, island_main, &islands.island[i]) != 0) { die("Cannot start island"); }
+    }
+    island_main(&islands.island[0]);
+    
     return 0;
 }
+#endif
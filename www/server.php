@@ -1,30 +1,91 @@
 <?php
 
 // Runs behind a webserver and stores and responds with gene sequences for xpol (cross-pool communication)
+// Requests:
+//   todo=get                   returns a random recent genes
+//   todo=getmany&count=K       returns K random recent genes, one per line
+//   todo=put&data=D            stores genes
+//   todo=putmany&data[]=D...   stores more genes at once
+// The pool id of the sender can be given in poolid
 
 $PATH = dirname(__FILE__);
 require $PATH . '/sqlbrite/sqlbrite.php';
 
-$db = new SQLBrite(new SQLite3($PATH.'/data/server.sqlite'));
-$lockfile = fopen($PATH.'/data/lock', 'w+');
-flock($lockfile, LOCK_EX); // we do this as sqlite fails if someone else has it open
+$KEEP = '-1 hour'; // how long genes are kept
+$EXPIRE_EVERY = 50; // delete the old genes in about one in this many puts
+$MAX_COUNT = 64; // genes in a getmany or putmany request
+
+$sqlite = new SQLite3($PATH.'/data/server.sqlite');
+$sqlite->busyTimeout(5000); // wait for the writer instead of failing
+$db = new SQLBrite($sqlite);
+// In WAL mode readers do not block the writer and the writer does not block readers
+$db->exec('pragma journal_mode = wal');
+$db->exec('pragma synchronous = normal');
+$db->exec('create table if not exists xpolgenes (poolid integer, genes text, created datetime default current_timestamp)');
+$db->exec('create index if not exists xpolgenes_created on xpolgenes (created)');
+
+function done($output) {
+    print($output);
+    exit;
+}
+
+// Returns the rowid of the first recent genes, or NULL if there are none
+function first_recent() {
+    global $db, $KEEP;
+    return $db->querysingle('select rowid from xpolgenes where created > datetime("now", ?) order by created limit 1', [$KEEP]);
+}
+
+// Returns count random recent genes (fewer if there are not as many)
+// Rows are inserted in time order, so the recent ones are a range of rowids: we pick random rowids in the range
+function sample($count) {
+    global $db;
+    $db->exec('begin');
+    $first = first_recent();
+    $last = $db->querysingle('select max(rowid) from xpolgenes');
+    $rows = [];
+    if(!is_null($first)) {
+        $count = min($count, $last - $first + 1);
+        for($tries = 0; count($rows) < $count && $tries < $count * 4; $tries++) {
+            $row = $db->querysinglerow('select rowid, genes from xpolgenes where rowid >= ? order by rowid limit 1', [random_int($first, $last)]);
+            if($row) { $rows[$row['rowid']] = $row['genes']; }
+        }
+    }
+    $db->exec('commit');
+    return array_values($rows);
+}
+
+// Stores the genes, and deletes the old ones now and then
+function store($data) {
+    global $db, $EXPIRE_EVERY;
+    $poolid = (isset($_POST['poolid']) ? intval($_POST['poolid']) : 0);
+    $db->exec('begin immediate');
+    foreach($data as $genes) {
+        $db->exec('insert into xpolgenes (poolid, genes) values (?, ?)', [$poolid, $genes]);
+    }
+    if(random_int(1, $EXPIRE_EVERY) == 1) {
+        $first = first_recent();
+        if(is_null($first)) { $db->exec('delete from xpolgenes'); }
+        else { $db->exec('delete from xpolgenes where rowid < ?', [$first]); }
+    }
+    $db->exec('commit');
+}
 
 if(isset($_POST['todo'])) {
     if($_POST['todo'] == 'get') {
-        $data = $db->querysingle('select genes from xpolgenes where created > datetime("now", "-1 hour") order by random() limit 1');
-        print($data);
-        flock($lockfile, LOCK_UN);
-        fclose($lockfile);
-        exit;
+        $rows = sample(1);
+        done(count($rows) ? $rows[0] : '');
+    }
+    if($_POST['todo'] == 'getmany' && isset($_POST['count'])) {
+        done(implode("\n", sample(max(1, min($MAX_COUNT, intval($_POST['count']))))));
+    }
+    if($_POST['todo'] == 'put' && isset($_POST['data']) && is_string($_POST['data'])) {
+        store([$_POST['data']]);
+        done('ok');
+    }
+    if($_POST['todo'] == 'putmany' && isset($_POST['data']) && is_array($_POST['data']) && count($_POST['data']) <= $MAX_COUNT) {
+        store(array_filter($_POST['data'], 'is_string'));
+        done('ok');
     }
-    if($_POST['todo'] == 'put' && isset($_POST['data'])) {
-        $db->exec('insert into xpolgenes (poolid, genes) values (?, ?)', [0, $_POST['data']]);
-        $db->exec('delete from xpolgenes where created < datetime("now", "-1 hour")');
-        print('ok');
-        flock($lockfile, LOCK_UN);
-        fclose($lockfile);
-        exit;
-    }    
 }
 
 http_response_code(500);